@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "config.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_MALLOC_TRIM
+# include <malloc.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "compress.h"
+#include "zst.h"
+
+// Runs are repeated until this much time has passed, the fastest counts.
+#define BENCH_TIME 1.0
+#define BENCH_MIN_RUNS 3
+#define BENCH_MAX_RUNS 1000
+#define CORPUS_SIZE (16*MB)
+
+// Writing 5 to clear_refs resets the peak resident memory, so that each
+// codec is measured on its own.  What the previous one freed must be given
+// back first, or it'd be reused without showing up.
+static void reset_peak(void)
+{
+#ifdef HAVE_MALLOC_TRIM
+    malloc_trim(0);
+#endif
+    int fd = open("/proc/self/clear_refs", O_WRONLY|O_CLOEXEC);
+    if (fd != -1)
+    {
+        if (write(fd, "5", 1)) {} // older kernels don't know it
+        close(fd);
+    }
+}
+
+// VmRSS is the resident memory now, VmHWM its peak.
+static unsigned long long mem_kb(const char *what)
+{
+    char line[128];
+    unsigned long long kb = 0;
+    FILE *f = fopen("/proc/self/status", "re");
+    if (!f)
+        return 0;
+    size_t len = strlen(what);
+    while (fgets(line, sizeof line, f))
+        if (!strncmp(line, what, len) && line[len] == ':')
+        {
+            kb = strtoull(line + len + 1, 0, 10);
+            break;
+        }
+    fclose(f);
+    return kb;
+}
+
+// Text-like data: words of skewed frequency, sometimes numbers, in lines.
+static void make_corpus(uint8_t *buf, size_t len)
+{
+    static const char *words[] =
+    {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+        "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+        "compress", "stream", "block", "window", "level", "thread", "file",
+        "data", "error", "value", "return", "buffer", "header", "magic",
+    };
+    const unsigned nw = sizeof words / sizeof *words;
+    uint32_t seed = 12345;
+    size_t i = 0, col = 0;
+    while (i < len)
+    {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 8, a = r % nw, b = (r >> 8) % nw;
+        char num[12];
+        const char *w = words[a < b? a : b];
+        if (!(r & 15))
+            sprintf(num, "%u", r >> 4 & 0xffff), w = num;
+        size_t wl = strlen(w);
+        for (size_t j = 0; j < wl && i < len; j++)
+            buf[i++] = w[j];
+        col += wl + 1;
+        if (i < len)
+            buf[i++] = col > 72? col = 0, '\n' : ' ';
+    }
+}
+
+// The fastest of several runs, in seconds; -1 on failure.
+static double time_runs(bool unpack, compress_info *ci, const uint8_t *data, size_t len,
+    file_info *restrict tmpl)
+{
+    double best = -1, start = now();
+    for (int run = 0; run < BENCH_MAX_RUNS; run++)
+    {
+        file_info fi = *tmpl;
+        fi.map = data;
+        fi.map_len = len;
+        double t = now();
+        if (unpack? decomp(0, -1, -1, &fi) : ci->comp(-1, -1, &fi, 0))
+            return -1;
+        t = now() - t;
+        if (best < 0 || t < best)
+            best = t;
+        if (run + 1 >= BENCH_MIN_RUNS && now() - start > BENCH_TIME)
+            break;
+    }
+    return best;
+}
+
+static int bench_one(compress_info *ci, int lev, const uint8_t *data, size_t len,
+    file_info *restrict tmpl)
+{
+    int err = 1;
+    uint8_t *zdata = MAP_FAILED;
+    unsigned long long zlen = 0;
+    level = lev;
+
+    // Once for real to have something to decompress and check, and to
+    // see how much memory each way takes.  Output written to a memfd
+    // isn't mapped so doesn't count.
+    int zfd = memfd_create("compressed", MFD_CLOEXEC);
+    if (zfd == -1)
+        goto fail;
+    file_info fi = *tmpl;
+    fi.map = data;
+    fi.map_len = len;
+    reset_peak();
+    unsigned long long base = mem_kb("VmRSS");
+    if (ci->comp(-1, zfd, &fi, 0))
+        goto end;
+    unsigned long long cmem = mem_kb("VmHWM") - base;
+    zlen = fi.sz;
+
+    int ufd = memfd_create("decompressed", MFD_CLOEXEC);
+    if (ufd == -1 || lseek(zfd, 0, SEEK_SET))
+        goto fail;
+    fi = *tmpl;
+    reset_peak();
+    base = mem_kb("VmRSS");
+    if (decomp(0, zfd, ufd, &fi))
+    {
+        close(ufd);
+        goto end;
+    }
+    unsigned long long dmem = mem_kb("VmHWM") - base;
+    uint8_t *udata = len? mmap(0, len, PROT_READ, MAP_SHARED, ufd, 0) : 0;
+    bool ok = fi.sd == len && udata != MAP_FAILED && (!len || !memcmp(data, udata, len));
+    if (len && udata != MAP_FAILED)
+        munmap(udata, len);
+    close(ufd);
+    if (!ok)
+    {
+        fprintf(stderr, "%s: %s -%d: decompressed data differs!\n", exe, ci->name, lev);
+        goto end;
+    }
+
+    // ... then timed, discarding the output.
+    if ((zdata = mmap(0, zlen, PROT_READ, MAP_SHARED|MAP_POPULATE, zfd, 0)) == MAP_FAILED)
+        goto fail;
+    double ct = time_runs(0, ci, data, len, tmpl);
+    double dt = ct < 0? -1 : time_runs(1, ci, zdata, zlen, tmpl);
+    if (dt < 0)
+        goto end;
+
+    printf("%-6s -%d %12llu %6.2f%% %8.1f MB/s %8.1f MB/s %7.1f MB %7.1f MB\n", ci->name, lev,
+        zlen, len? 100.0 * zlen / len : 0, len / ct / MB, len / dt / MB,
+        cmem / 1024.0, dmem / 1024.0);
+    fflush(stdout);
+    err = 0;
+    goto end;
+
+fail:
+    fprintf(stderr, "%s: %s -%d: %m\n", exe, ci->name, lev);
+end:
+    if (zdata != MAP_FAILED)
+        munmap(zdata, zlen);
+    if (zfd != -1)
+        close(zfd);
+    return err;
+}
+
+// -b: every codec (or just the one given) at each level, on the given file
+// held in memory, or on a synthetic corpus without one.
+int benchmark(const char *path, compress_info *only, int lo, int hi)
+{
+    int err = 0;
+    size_t len = CORPUS_SIZE;
+    uint8_t *data;
+    file_info tmpl = {.path = "", .name_in = path?: "corpus", .name_out = "output"};
+
+    if (path)
+    {
+        struct stat sb;
+        int fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &sb))
+        {
+            fprintf(stderr, "%s: %s: %m\n", exe, path);
+            if (fd != -1)
+                close(fd);
+            return 1;
+        }
+        len = sb.st_size;
+        // prefault, so the first run doesn't pay for the reading
+        data = len? mmap(0, len, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0) : (void*)"";
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "%s: %s: %m\n", exe, path);
+            return 1;
+        }
+    }
+    else
+    {
+        data = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "%s: %m\n", exe);
+            return 1;
+        }
+        make_corpus(data, len);
+    }
+
+    printf("%s: %zu bytes\n", tmpl.name_in, len);
+    printf("format lv   compressed  ratio     compress   decompress   c. mem     d. mem\n");
+    for (compress_info *ci = only?: compressors; ci->name; ci++)
+    {
+        const char *why = comp_load(ci);
+        if (why)
+        {
+            fprintf(stderr, "%s: %s\n", exe, why);
+            err = 1;
+        }
+        else
+            for (int lev = lo; lev <= hi; lev++)
+                err |= bench_one(ci, lev, data, len, &tmpl);
+        if (only)
+            break;
+    }
+
+    if (len)
+        munmap(data, len);
+    return err;
+}
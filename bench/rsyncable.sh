@@ -0,0 +1,43 @@
+#!/bin/sh
+# How much of a compressed file a delta transfer can reuse after a small
+# edit in the middle of the input, with and without --rsyncable.
+#   bench/rsyncable.sh [zst binary] [input file]
+# The input defaults to 48MB of random-ish text; it needs to be well
+# above zstd's job size (8MB at the default level) to show anything.
+set -e
+Z=${1:-./zst}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+if [ -n "$2" ]; then
+	cp "$2" "$TMP/a"
+else
+	head -c 12M /dev/urandom|od >"$TMP/a"
+fi
+half=$(($(wc -c <"$TMP/a") / 2))
+{ head -c $half "$TMP/a"; echo edit; tail -c +$((half + 1)) "$TMP/a"; } >"$TMP/b"
+
+# rsync-style: the share of the new file made of 2KB blocks found at any
+# offset in the old one
+reused()
+{
+	perl -e '
+		$B = 2048;
+		open A, $ARGV[0]; binmode A; local $/; $a = <A>;
+		open B, $ARGV[1]; binmode B; $b = <B>;
+		for ($i = 0; $i + $B <= length $a; $i += $B) { $h{substr $a, $i, $B} = 1 }
+		for ($i = 0; $i + $B <= length $b;) {
+			if ($h{substr $b, $i, $B}) { $n += $B; $i += $B } else { $i++ }
+		}
+		printf "%5.1f%%", 100 * $n / length $b' "$1" "$2"
+}
+
+printf "%-6s %-12s %10s %7s\n" format mode size reused
+for fmt in gzip zstd; do
+	for mode in "" --rsyncable; do
+		"$Z" -F$fmt $mode <"$TMP/a" >"$TMP/a.z"
+		"$Z" -F$fmt $mode <"$TMP/b" >"$TMP/b.z"
+		printf "%-6s %-12s %10s %7s\n" $fmt "${mode:-default}" \
+			$(wc -c <"$TMP/a.z") "$(reused "$TMP/a.z" "$TMP/b.z")"
+	done
+done
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Bulk runs over many small files, where syscalls rather than codecs take
+# the time: compress, test and decompress a tree of 2KB files with --io-uring
+# and without.
+#   bench/smallfiles.sh [zst binary] [files] [zst options...]
+set -e
+Z=${1:-./zst}
+N=${2:-100000}
+shift 2 || shift $#
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# text-like, a thousand files per directory
+awk -v n="$N" -v dir="$TMP/t" 'BEGIN {
+	srand(1)
+	for (i = 0; i < n; i++) {
+		if (!(i % 1000))
+			system("mkdir -p " dir "/" int(i / 1000))
+		f = dir "/" int(i / 1000) "/" i
+		s = ""
+		while (length(s) < 2047)
+			s = s int(rand() * rand() * 1000) " "
+		printf "%s\n", substr(s, 1, 2047) > f
+		close(f)
+	}
+}'
+
+ms()
+{
+	start=$(date +%s%N)
+	"$@"
+	end=$(date +%s%N)
+	echo $(((end - start) / 1000000))
+}
+
+for io in sync io_uring; do
+	[ $io = io_uring ] && set -- "$@" --io-uring
+	sync
+	c=$(ms "$Z" -r "$@" "$TMP/t")
+	t=$(ms "$Z" -tr "$@" "$TMP/t")
+	d=$(ms "$Z" -dr "$@" "$TMP/t")
+	echo "$io: compress ${c}ms, test ${t}ms, decompress ${d}ms for $N files"
+done
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Per-process startup cost, as paid by eg. the less hook for every file:
+# many runs of decompressing a tiny file.  Build once with
+# -DUSE_DLOPEN=OFF and once with the default to compare.
+#   bench/startup.sh [zst binary] [runs]
+set -e
+Z=${1:-./zst}
+N=${2:-1000}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+echo hello >"$TMP/f"
+for fmt in gzip zstd; do
+	"$Z" -F$fmt <"$TMP/f" >"$TMP/f.$fmt"
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt $N ]; do
+		"$Z" -dc <"$TMP/f.$fmt" >/dev/null
+		i=$((i + 1))
+	done
+	end=$(date +%s%N)
+	echo "$fmt: $(((end - start) / N / 1000))µs per run"
+done
@@ -6,10 +6,24 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include "dl.h"
 #ifdef HAVE_LIBBZ3
 # include <libbz3.h>
+# define BZ3_SYMS(X) \
+    X(bz3_bound) X(bz3_decode_block) X(bz3_encode_block) X(bz3_free) \
+    X(bz3_new) X(bz3_strerror)
+DL_LIB(lib_bz3, SONAME_BZ3, BZ3_SYMS)
+# ifdef USE_DLOPEN
+#  define bz3_bound dl_bz3_bound
+#  define bz3_decode_block dl_bz3_decode_block
+#  define bz3_encode_block dl_bz3_encode_block
+#  define bz3_free dl_bz3_free
+#  define bz3_new dl_bz3_new
+#  define bz3_strerror dl_bz3_strerror
+# endif
 #endif
 #include "compress.h"
+#include "worker.h"
 #include "zst.h"
 
 #define BUFFER_SIZE 32768
@@ -33,63 +47,182 @@ static uint32_t get_u32(const void *mem)
     return htole32(bad_endian);
 }
 
+typedef struct
+{
+    worker              w;
+    struct bz3_state    *state;
+    uint8_t             *buffer;
+    uint32_t            blen;
+    int32_t             dlen, zlen, ret;
+    bool                full;
+} bz3_job;
+
+// How many blocks can be in flight at once.
+static int bz3_slots(uint32_t blen)
+{
+    // a state takes ~6 block sizes, plus the i/o buffer
+    unsigned long long per_slot = 7ULL * blen;
+    int n = threads;
+
+    if (memlimit && n * per_slot > memlimit)
+        n = memlimit / per_slot;
+    return n?: 1;
+}
+
+// Blocks don't depend on each other, so a state can go on to the next
+// file as is; one per thread is kept, for the same block size.
+static __thread struct
+{
+    struct bz3_state    *state;
+    uint8_t             *buffer;
+    uint32_t            blen;
+} spare;
+
+// sets errno on failure
+static bool init_job(bz3_job *job, uint32_t blen, bool threaded, void (*func)(worker *w))
+{
+    job->blen = blen;
+    if (spare.state && spare.blen == blen)
+    {
+        job->state = spare.state;
+        job->buffer = spare.buffer;
+        spare.state = 0;
+        spare.buffer = 0;
+    }
+    else if (!(job->state = bz3_new(blen)) || !(job->buffer = malloc(bz3_bound(blen))))
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    return !threaded || worker_start(&job->w, func);
+}
+
+static void free_jobs(bz3_job *jobs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        worker_stop(&jobs[i].w);
+        if (!spare.state && jobs[i].state && jobs[i].buffer)
+        {
+            spare.state = jobs[i].state;
+            spare.buffer = jobs[i].buffer;
+            spare.blen = jobs[i].blen;
+            continue;
+        }
+        if (jobs[i].state)
+            bz3_free(jobs[i].state);
+        free(jobs[i].buffer);
+    }
+    free(jobs);
+}
+
+void bz3_pool_free(void)
+{
+    if (spare.state)
+        bz3_free(spare.state);
+    free(spare.buffer);
+    spare.state = 0;
+    spare.buffer = 0;
+}
+
+static void decode_job(worker *w)
+{
+    bz3_job *job = (bz3_job*)w;
+    job->ret = bz3_decode_block(job->state, job->buffer, job->zlen, job->dlen);
+}
+
+// Headers give both lengths, so blocks can be read ahead and handed to
+// slots the same way as when compressing.  Returns 0 on EOF, -1 on error,
+// or the head of the next concatenated stream.
 static uint64_t decompress_bz3(int in, int out, file_info *restrict fi, uint32_t blen)
 {
-    uint64_t bhead;
-    uint8_t *buffer = 0;
-    struct bz3_state *state = bz3_new(blen);
+    uint64_t bhead, next = 0;
+    int n = bz3_slots(blen), busy = 0;
+    bool eof = 0;
+    bz3_job *jobs = calloc(n, sizeof(bz3_job));
 
-    if (!state)
-        ERRoom(fail, in);
-    buffer = malloc(bz3_bound(blen));
-    if (!buffer)
-        ERRoom(fail, in);
+    if (!jobs)
+        ERRoom(end, in);
 
-    while (1)
+    for (int i = 0; !eof || busy; i = (i + 1) % n)
     {
-        int ret = read(in, &bhead, 8);
+        bz3_job *job = &jobs[i];
+
+        if (job->full)
+        {
+            worker_wait(&job->w);
+            busy--;
+            if (job->ret != job->dlen)
+                ERR(fail, in, "file corrupted: %s", bz3_strerror(job->state));
+            if (write_out(out, fi, job->buffer, job->dlen))
+                ERRlibc(fail, out);
+
+            fi->sd += job->dlen;
+            fi->sz += job->zlen + 8;
+            job->full = 0;
+        }
+        if (eof)
+            continue;
+
+        // On input errors, blocks already read are still written out.
+        ssize_t ret = copy_input(in, fi, &bhead, 8);
         if (ret != 8)
-            if (!ret)
-                break;
-            else if (ret == -1)
-                ERRlibc(fail, in);
-            else
-                ERRueof(fail, in);
+        {
+            if (ret == -1)
+                GRIPE(in, "%m\n");
+            else if (ret)
+                GRIPE(in, "unexpected end of file\n");
+            eof = 1;
+            next = ret? -1 : 0;
+            continue;
+        }
         uint32_t *bhead32 = (void*)&bhead;
         uint32_t zlen = htole32(bhead32[0]);
         uint32_t dlen = htole32(bhead32[1]);
 
         if (zlen == 0x76335a42)
         {
-            bz3_free(state);
-            free(buffer);
-            return bhead;
+            eof = 1;
+            next = bhead;
+            continue;
         }
 
         if (dlen > blen || zlen > blen + 31)
-            ERR(fail, in, "file corrupted: inconsistent headers");
+        {
+            GRIPE(in, "file corrupted: inconsistent headers\n");
+            eof = 1;
+            next = -1;
+            continue;
+        }
 
-        ssize_t iolen = read(in, buffer, zlen);
-        if (iolen != zlen)
-            if (iolen == -1)
-                ERRlibc(fail, in);
+        if (!job->state && !init_job(job, blen, n > 1, decode_job))
+            ERRlibc(fail, in);
+        ret = copy_input(in, fi, job->buffer, zlen);
+        if (ret != zlen)
+        {
+            if (ret == -1)
+                GRIPE(in, "%m\n");
             else
-                ERRueof(fail, in);
-        if (bz3_decode_block(state, buffer, zlen, dlen) != dlen)
-            ERR(fail, in, "file corrupted: %s", bz3_strerror(state));
-        if (rewrite(out, buffer, dlen))
-            ERRlibc(fail, out);
-
-        fi->sd += dlen;
-        fi->sz += zlen + 8;
+                GRIPE(in, "unexpected end of file\n");
+            eof = 1;
+            next = -1;
+            continue;
+        }
+        job->zlen = zlen;
+        job->dlen = dlen;
+        job->full = 1;
+        if (n > 1)
+            worker_run(&job->w);
+        else
+            decode_job(&job->w);
+        busy++;
     }
-    bz3_free(state);
-    free(buffer);
-    return 0;
+    free_jobs(jobs, n);
+    return next;
 
 fail:
-    bz3_free(state);
-    free(buffer);
+    free_jobs(jobs, n);
+end:
     return -1;
 }
 
@@ -104,7 +237,7 @@ new_stream:
     // Read the stream header.
     {
         int hlen = head? MLEN : 0;
-        int ret = read(in, shead + hlen, 9 - hlen);
+        int ret = copy_input(in, fi, shead + hlen, 9 - hlen);
         if (ret != 9 - hlen)
             if (ret == -1)
                 ERRlibc(fail, in);
@@ -128,37 +261,106 @@ fail:
     return 1;
 }
 
+// -l: block headers give both lengths, the payloads are seeked over.
+int list_bz3(int in, file_info *restrict fi)
+{
+    uint8_t h[9];
+    unsigned long long pos = 0, size = fi->sz;
+    uint32_t blen = 0;
+
+    while (pos < size)
+    {
+        if (pos + 8 > size || pread_in(in, fi, h, pos + 9 <= size? 9 : 8, pos))
+            ERRueof(fail, in);
+        if (!memcmp(h, "BZ3v1", 5)) // a stream, maybe concatenated
+        {
+            if (pos + 9 > size)
+                ERRueof(fail, in);
+            blen = get_u32(h + 5);
+            if (blen < MIN_BLOCK || blen > MAX_BLOCK)
+                ERR(fail, in, "file corrupted: invalid block size in header");
+            pos += 9;
+            continue;
+        }
+        uint32_t zlen = get_u32(h), dlen = get_u32(h + 4);
+        if (!blen || dlen > blen || zlen > blen + 31)
+            ERR(fail, in, "file corrupted: inconsistent headers");
+        fi->sd += dlen;
+        pos += 8 + zlen;
+    }
+    if (pos != size)
+        ERRueof(fail, in);
+    return 0;
+
+fail:
+    return 1;
+}
+
+static void encode_job(worker *w)
+{
+    bz3_job *job = (bz3_job*)w;
+    job->zlen = bz3_encode_block(job->state, job->buffer, job->dlen);
+}
+
+// Blocks are independent: each of n slots owns a state and a thread,
+// they're filled round-robin, and collected in the same order -- which
+// keeps the output identical to a serial run.
 static bool compress_bz3(int in, int out, file_info *restrict fi, uint32_t blen)
 {
-    uint8_t *buffer = 0;
-    struct bz3_state *state = bz3_new(blen);
-    ssize_t dlen = 0;
-    size_t zlen;
+    int n = bz3_slots(blen), busy = 0;
+    bool eof = 0, err = 1;
+    bz3_job *jobs = calloc(n, sizeof(bz3_job));
 
-    if (!state)
-        ERRoom(end, in);
-    buffer = malloc(bz3_bound(blen));
-    if (!buffer)
+    if (!jobs)
         ERRoom(end, in);
 
-    while ((dlen = read(in, buffer, blen)))
+    for (int i = 0; !eof || busy; i = (i + 1) % n)
     {
-        if (dlen == -1)
-            ERRlibc(end, in);
-        if ((zlen = bz3_encode_block(state, buffer, dlen)) < 0)
-            ERR(end, in, "%s", bz3_strerror(state));
-        uint32_t bhead[2] = {zlen, dlen};
-        if (rewrite(out, bhead, sizeof bhead) || rewrite(out, buffer, zlen))
-            ERRlibc(end, out);
+        bz3_job *job = &jobs[i];
 
-        fi->sd += dlen;
-        fi->sz += zlen + 8;
+        if (job->full)
+        {
+            worker_wait(&job->w);
+            busy--;
+            if (job->zlen < 0)
+                ERR(fail, in, "%s", bz3_strerror(job->state));
+            uint32_t bhead[2] = {job->zlen, job->dlen};
+            if (write_out(out, fi, bhead, sizeof bhead) || write_out(out, fi, job->buffer, job->zlen))
+                ERRlibc(fail, out);
+
+            fi->sd += job->dlen;
+            fi->sz += job->zlen + 8;
+            job->full = 0;
+        }
+        if (eof)
+            continue;
+
+        // set up slots lazily, small files need only one
+        if (!job->state && !init_job(job, blen, n > 1, encode_job))
+            ERRlibc(fail, in);
+
+        ssize_t dlen = copy_input(in, fi, job->buffer, blen);
+        if (dlen == -1)
+            ERRlibc(fail, in);
+        if (!dlen)
+        {
+            eof = 1;
+            continue;
+        }
+        job->dlen = dlen;
+        job->full = 1;
+        if (n > 1)
+            worker_run(&job->w);
+        else
+            encode_job(&job->w);
+        busy++;
     }
+    err = 0;
 
+fail:
+    free_jobs(jobs, n);
 end:
-    bz3_free(state);
-    free(buffer);
-    return !!dlen;
+    return err;
 }
 
 int write_bz3(int in, int out, file_info *restrict fi, magic_t head)
@@ -182,7 +384,7 @@ int write_bz3(int in, int out, file_info *restrict fi, magic_t head)
     {
         char shead[12] = "\0\0\0BZ3v1";
         *((uint32_t*)(shead+8)) = htole32(blen);
-        if (rewrite(out, shead+3, 9))
+        if (write_out(out, fi, shead+3, 9))
             ERRlibc(fail, out);
         fi->sz += 9;
     }
@@ -2,27 +2,174 @@
 #include "config.h"
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dl.h"
 #ifdef HAVE_LIBBZ2
 # include <bzlib.h>
+# define BZ2_SYMS(X) \
+    X(BZ2_bzBuffToBuffCompress) X(BZ2_bzCompress) X(BZ2_bzCompressEnd) \
+    X(BZ2_bzCompressInit) X(BZ2_bzDecompress) X(BZ2_bzDecompressEnd) \
+    X(BZ2_bzDecompressInit)
+DL_LIB(lib_bz2, SONAME_BZ2, BZ2_SYMS)
+# ifdef USE_DLOPEN
+#  define BZ2_bzBuffToBuffCompress dl_BZ2_bzBuffToBuffCompress
+#  define BZ2_bzCompress dl_BZ2_bzCompress
+#  define BZ2_bzCompressEnd dl_BZ2_bzCompressEnd
+#  define BZ2_bzCompressInit dl_BZ2_bzCompressInit
+#  define BZ2_bzDecompress dl_BZ2_bzDecompress
+#  define BZ2_bzDecompressEnd dl_BZ2_bzDecompressEnd
+#  define BZ2_bzDecompressInit dl_BZ2_bzDecompressInit
+# endif
 #endif
 #ifdef HAVE_LIBZ
 # include <zlib.h>
+# define Z_SYMS(X) \
+    X(compress2) X(compressBound) X(crc32) X(crc32_combine) X(deflate) \
+    X(deflateEnd) X(deflateInit2_) X(deflateParams) X(deflateReset) \
+    X(deflateSetDictionary) X(inflate) X(inflateEnd) \
+    X(inflateGetDictionary) X(inflateInit2_) X(inflatePrime) \
+    X(inflateReset) X(inflateReset2) X(inflateSetDictionary) X(uncompress)
+DL_LIB(lib_z, SONAME_Z, Z_SYMS)
+# ifdef USE_DLOPEN
+#  define compress2 dl_compress2
+#  define compressBound dl_compressBound
+#  define crc32 dl_crc32
+#  define crc32_combine dl_crc32_combine
+#  define deflate dl_deflate
+#  define deflateEnd dl_deflateEnd
+#  define deflateInit2_ dl_deflateInit2_
+#  define deflateParams dl_deflateParams
+#  define deflateReset dl_deflateReset
+#  define deflateSetDictionary dl_deflateSetDictionary
+#  define inflate dl_inflate
+#  define inflateEnd dl_inflateEnd
+#  define inflateGetDictionary dl_inflateGetDictionary
+#  define inflateInit2_ dl_inflateInit2_
+#  define inflatePrime dl_inflatePrime
+#  define inflateReset dl_inflateReset
+#  define inflateReset2 dl_inflateReset2
+#  define inflateSetDictionary dl_inflateSetDictionary
+#  define uncompress dl_uncompress
+# endif
 #endif
 #ifdef HAVE_LIBLZMA
 # include <lzma.h>
+# ifdef HAVE_LZMA_ENCODER_MT
+#  define LZMA_ENC_MT_SYMS(X) X(lzma_stream_encoder_mt)
+# else
+#  define LZMA_ENC_MT_SYMS(X)
+# endif
+# ifdef HAVE_LZMA_DECODER_MT
+#  define LZMA_DEC_MT_SYMS(X) X(lzma_stream_decoder_mt) X(lzma_physmem)
+# else
+#  define LZMA_DEC_MT_SYMS(X)
+# endif
+# ifdef HAVE_LZMA_FILE_INFO
+#  define LZMA_INFO_SYMS(X) \
+    X(lzma_file_info_decoder) X(lzma_index_end) X(lzma_index_uncompressed_size)
+# else
+#  define LZMA_INFO_SYMS(X)
+# endif
+# define LZMA_SYMS(X) \
+    X(lzma_code) X(lzma_easy_encoder) X(lzma_end) X(lzma_stream_decoder) \
+    LZMA_ENC_MT_SYMS(X) LZMA_DEC_MT_SYMS(X) LZMA_INFO_SYMS(X)
+DL_LIB(lib_lzma, SONAME_LZMA, LZMA_SYMS)
+# ifdef USE_DLOPEN
+#  define lzma_code dl_lzma_code
+#  define lzma_easy_encoder dl_lzma_easy_encoder
+#  define lzma_end dl_lzma_end
+#  define lzma_stream_decoder dl_lzma_stream_decoder
+#  define lzma_stream_encoder_mt dl_lzma_stream_encoder_mt
+#  define lzma_stream_decoder_mt dl_lzma_stream_decoder_mt
+#  define lzma_physmem dl_lzma_physmem
+#  define lzma_file_info_decoder dl_lzma_file_info_decoder
+#  define lzma_index_end dl_lzma_index_end
+#  define lzma_index_uncompressed_size dl_lzma_index_uncompressed_size
+# endif
 #endif
 #ifdef HAVE_LIBZSTD
+# define ZSTD_STATIC_LINKING_ONLY // ZSTD_c_rsyncable is "experimental"
 # include <zstd.h>
+# include <zdict.h>
+# define ZSTD_SYMS(X) \
+    X(ZDICT_getErrorName) X(ZDICT_isError) X(ZDICT_trainFromBuffer) \
+    X(ZSTD_CCtx_refCDict) X(ZSTD_CCtx_reset) X(ZSTD_CCtx_setParameter) \
+    X(ZSTD_CCtx_setPledgedSrcSize) X(ZSTD_CStreamInSize) \
+    X(ZSTD_CStreamOutSize) X(ZSTD_DCtx_refDDict) X(ZSTD_DCtx_reset) \
+    X(ZSTD_DCtx_setParameter) \
+    X(ZSTD_DStreamInSize) X(ZSTD_DStreamOutSize) X(ZSTD_compressStream2) \
+    X(ZSTD_createCCtx) X(ZSTD_createCDict) X(ZSTD_createDDict) \
+    X(ZSTD_createDStream) X(ZSTD_decompressDCtx) X(ZSTD_decompressStream) \
+    X(ZSTD_freeCCtx) X(ZSTD_freeDStream) X(ZSTD_getErrorName) \
+    X(ZSTD_getFrameHeader) X(ZSTD_initDStream) X(ZSTD_isError)
+DL_LIB(lib_zstd, SONAME_ZSTD, ZSTD_SYMS)
+# ifdef USE_DLOPEN
+#  define ZDICT_getErrorName dl_ZDICT_getErrorName
+#  define ZDICT_isError dl_ZDICT_isError
+#  define ZDICT_trainFromBuffer dl_ZDICT_trainFromBuffer
+#  define ZSTD_CCtx_refCDict dl_ZSTD_CCtx_refCDict
+#  define ZSTD_CCtx_reset dl_ZSTD_CCtx_reset
+#  define ZSTD_CCtx_setParameter dl_ZSTD_CCtx_setParameter
+#  define ZSTD_CCtx_setPledgedSrcSize dl_ZSTD_CCtx_setPledgedSrcSize
+#  define ZSTD_CStreamInSize dl_ZSTD_CStreamInSize
+#  define ZSTD_CStreamOutSize dl_ZSTD_CStreamOutSize
+#  define ZSTD_DCtx_refDDict dl_ZSTD_DCtx_refDDict
+#  define ZSTD_DCtx_reset dl_ZSTD_DCtx_reset
+#  define ZSTD_DCtx_setParameter dl_ZSTD_DCtx_setParameter
+#  define ZSTD_DStreamInSize dl_ZSTD_DStreamInSize
+#  define ZSTD_DStreamOutSize dl_ZSTD_DStreamOutSize
+#  define ZSTD_compressStream2 dl_ZSTD_compressStream2
+#  define ZSTD_createCCtx dl_ZSTD_createCCtx
+#  define ZSTD_createCDict dl_ZSTD_createCDict
+#  define ZSTD_createDDict dl_ZSTD_createDDict
+#  define ZSTD_createDStream dl_ZSTD_createDStream
+#  define ZSTD_decompressDCtx dl_ZSTD_decompressDCtx
+#  define ZSTD_decompressStream dl_ZSTD_decompressStream
+#  define ZSTD_freeCCtx dl_ZSTD_freeCCtx
+#  define ZSTD_freeDStream dl_ZSTD_freeDStream
+#  define ZSTD_getErrorName dl_ZSTD_getErrorName
+#  define ZSTD_getFrameHeader dl_ZSTD_getFrameHeader
+#  define ZSTD_initDStream dl_ZSTD_initDStream
+#  define ZSTD_isError dl_ZSTD_isError
+# endif
 #endif
 #include "compress.h"
+#include "ring.h"
+#include "worker.h"
 #include "zst.h"
 
 #define U64(x) (*((uint64_t*)(x)))
 
+static void put_le32(uint8_t *buf, uint32_t v)
+{
+    for (int i = 0; i < 4; i++, v >>= 8)
+        buf[i] = v;
+}
+
+static uint32_t get_le32(const uint8_t *buf)
+{
+    return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static void put_le64(uint8_t *buf, uint64_t v)
+{
+    put_le32(buf, v);
+    put_le32(buf + 4, v >> 32);
+}
+
+static uint64_t get_le64(const uint8_t *buf)
+{
+    return get_le32(buf) | (uint64_t)get_le32(buf + 4) << 32;
+}
+
 #define BUFFER_SIZE 32768
 
 #define GRIPE(f,msg,...) fprintf(stderr, "%s: %s%s: " msg, exe, fi->path, fi->name_##f?: "std" #f,##__VA_ARGS__)
@@ -50,6 +197,356 @@ int rewrite(int fd, const void *buf, size_t len)
     return 0;
 }
 
+// Like read() but doesn't return short counts except at EOF.
+ssize_t reread(int fd, void *buf, size_t len)
+{
+    size_t total = 0;
+
+    while (len)
+    {
+        ssize_t done = read(fd, buf, len);
+        if (done == -1)
+            if (errno == EINTR)
+                continue;
+            else
+                return -1;
+        if (!done)
+            break;
+        buf += done;
+        len -= done;
+        total += done;
+    }
+    return total;
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// reread(), counted.
+static ssize_t read_in(int fd, file_info *restrict fi, void *buf, size_t len)
+{
+    if (fi->from)
+        return ring_read(fi->from, buf, len);
+    if (!fi->stats)
+        return reread(fd, buf, len);
+
+    double t = now();
+    ssize_t r = reread(fd, buf, len);
+    fi->stats->reads++;
+    fi->stats->read_time += now() - t;
+    return r;
+}
+
+// pread() that must get it all, counted.
+int pread_in(int fd, file_info *restrict fi, void *buf, size_t len, off_t off)
+{
+    double t = fi->stats? now() : 0;
+    while (len)
+    {
+        ssize_t r = pread(fd, buf, len, off);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return r? -1 : (errno = EIO, -1); // shrunk under us
+        buf += r;
+        len -= r;
+        off += r;
+        if (fi->stats)
+            fi->stats->reads++;
+    }
+    if (fi->stats)
+        fi->stats->read_time += now() - t;
+    return 0;
+}
+
+#define MAP_AHEAD (16*MB)
+
+// Holes are handed out from here; untouched .bss maps to the kernel's
+// shared zero page so this costs no memory.
+static uint8_t zeroes[1*MB];
+
+// Whether the next len bytes lie entirely within a hole.  Only the next
+// hole is remembered, as input is consumed in order.
+static bool in_hole(int fd, file_info *restrict fi, size_t len)
+{
+#ifndef SEEK_HOLE
+    return 0;
+#else
+    off_t pos = fi->in_pos;
+    if (pos >= fi->hole_end)
+    {
+        off_t h = lseek(fd, pos, SEEK_HOLE);
+        off_t d = h == -1? -1 : lseek(fd, h, SEEK_DATA);
+        if (d == -1 && h != -1 && errno == ENXIO) // hole runs to EOF
+            d = lseek(fd, 0, SEEK_END);
+        if (lseek(fd, pos, SEEK_SET) == -1 || h == -1 || d == -1)
+        {
+            fi->holes = 0;
+            return 0;
+        }
+        fi->hole_start = h;
+        fi->hole_end = d;
+    }
+    return pos >= fi->hole_start && pos + len <= fi->hole_end;
+#endif
+}
+
+// Gets up to len bytes of input, short only at EOF or in a hole longer
+// than zeroes[].  If the input is mapped, *data points into the mapping
+// and buf is left alone (it may be null), else it's read into buf.  Holes
+// in sparse files aren't read at all.
+ssize_t get_input(int fd, file_info *restrict fi, const void **data, void *buf, size_t len)
+{
+    if (fi->from)
+    {
+        *data = buf;
+        return ring_read(fi->from, buf, len);
+    }
+    if (fi->map && len > fi->map_len - fi->in_pos)
+        len = fi->map_len - fi->in_pos;
+
+    if (fi->holes && len && in_hole(fd, fi, len))
+    {
+        if (len > sizeof zeroes)
+            len = sizeof zeroes;
+        if (!fi->map && lseek(fd, fi->in_pos + len, SEEK_SET) == -1)
+            return -1;
+        if (!fi->map && fi->stats)
+            fi->stats->seeks++;
+        fi->in_pos += len;
+        *data = zeroes;
+        return len;
+    }
+
+    if (!fi->map)
+    {
+        *data = buf;
+        ssize_t r = read_in(fd, fi, buf, len);
+        if (r > 0)
+            fi->in_pos += r;
+        return r;
+    }
+
+    *data = fi->map + fi->in_pos;
+    fi->in_pos += len;
+
+    // keep readahead a window ahead of us, without asking for all at once
+    if (fi->in_pos + MAP_AHEAD / 2 > fi->map_ahead && fi->map_ahead < fi->map_len)
+    {
+        size_t ahead = fi->map_len - fi->map_ahead;
+        madvise((void*)(fi->map + fi->map_ahead), ahead < MAP_AHEAD? ahead : MAP_AHEAD, MADV_WILLNEED);
+        fi->map_ahead += MAP_AHEAD;
+    }
+    return len;
+}
+
+typedef uint64_t zvec __attribute__((vector_size(32), aligned(1), may_alias));
+
+// Vectorized, bails out at the first nonzero 256 bytes.
+static bool all_zero(const void *buf, size_t len)
+{
+    const uint8_t *p = buf, *end = p + len;
+    uint64_t r = 0;
+
+    while (end - p >= 8 * sizeof(zvec))
+    {
+        const zvec *v = (const zvec*)p;
+        zvec acc = v[0] | v[1] | v[2] | v[3] | v[4] | v[5] | v[6] | v[7];
+        if (acc[0] | acc[1] | acc[2] | acc[3])
+            return 0;
+        p += 8 * sizeof(zvec);
+    }
+    while (p < end)
+        r |= *p++;
+    return !r;
+}
+
+static int write_data(int fd, file_info *restrict fi, const void *buf, size_t len)
+{
+    if (!len)
+        return 0;
+    if (fi->hole)
+    {
+        if (lseek(fd, fi->hole, SEEK_CUR) == -1)
+            return -1;
+        fi->hole = 0;
+        if (fi->stats)
+            fi->stats->seeks++;
+    }
+    if (fi->stats && fd != -1)
+        fi->stats->writes++;
+    return rewrite(fd, buf, len);
+}
+
+static int write_sparse(int fd, file_info *restrict fi, const void *buf, size_t len);
+
+// All output goes through here.
+int write_out(int fd, file_info *restrict fi, const void *buf, size_t len)
+{
+    if (fi->to)
+        return ring_write(fi->to, buf, len);
+    if (!fi->stats)
+        return fi->blksize? write_sparse(fd, fi, buf, len) : rewrite(fd, buf, len);
+
+    double t = now();
+    int r = fi->blksize? write_sparse(fd, fi, buf, len) : write_data(fd, fi, buf, len);
+    fi->stats->write_time += now() - t;
+    return r;
+}
+
+// If the output is a regular file, whole filesystem blocks of zeroes are
+// seeked over rather than written, leaving holes; end_output() then sets
+// the final size.  Output comes in pieces that needn't line up with
+// blocks, so zeroes that start a block are held back until the block
+// either ends (a hole) or turns out to have data (seeked over, the write
+// after fills them in).
+static int write_sparse(int fd, file_info *restrict fi, const void *buf, size_t len)
+{
+    const char *p = buf, *data = buf, *end = p + len;
+    while (p < end)
+    {
+        size_t off = fi->out_pos % fi->blksize, n = fi->blksize - off;
+        if (n > end - p)
+            n = end - p;
+        if (fi->zeros == off && all_zero(p, n))
+        {
+            if (write_data(fd, fi, data, p - data))
+                return -1;
+            data = p + n;
+            if ((fi->zeros += n) == fi->blksize)
+            {
+                fi->hole += fi->zeros;
+                fi->zeros = 0;
+            }
+        }
+        else if (fi->zeros) // only ever at the start of a call
+        {
+            fi->hole += fi->zeros;
+            fi->zeros = 0;
+        }
+        p += n;
+        fi->out_pos += n;
+    }
+    return write_data(fd, fi, data, end - data);
+}
+
+static int end_output(int out, file_info *restrict fi)
+{
+    fi->hole += fi->zeros;
+    fi->zeros = 0;
+    if (!fi->hole)
+        return 0;
+    off_t size = lseek(out, fi->hole, SEEK_CUR);
+    if (size == -1 || ftruncate(out, size))
+        ERRlibc(end, out);
+    fi->hole = 0;
+    if (fi->stats)
+        fi->stats->seeks++;
+    return 0;
+
+end:
+    return 1;
+}
+
+// Each thread keeps what the last file needed -- buffers here, contexts
+// by each codec -- so that a run over many small files sets up once per
+// thread rather than per file.  Taking empties the slot, so nested use
+// just allocates anew; what's given back with no room is freed.
+enum { BUF_IN, BUF_OUT, BUF_SLOTS };
+static __thread struct
+{
+    void                *p;
+    size_t              size;
+} bufs[BUF_SLOTS];
+
+static void *buf_take(int slot, size_t size)
+{
+    void *p = bufs[slot].p;
+    if (!p || bufs[slot].size < size)
+        return malloc(size);
+    bufs[slot].p = 0;
+    return p;
+}
+
+static void buf_give(int slot, void *p, size_t size)
+{
+    if (!p)
+        return;
+    if (bufs[slot].p && bufs[slot].size >= size)
+    {
+        free(p);
+        return;
+    }
+    free(bufs[slot].p);
+    bufs[slot].p = p;
+    bufs[slot].size = size;
+}
+
+// --adaptive: every so often, look at where the time went.  If we sat
+// waiting for output to drain, or for input to arrive, there's time to
+// compress harder; if neither ever blocked, we're what everyone else is
+// waiting on.  Needs fi->stats for the timings.
+#define ADAPT_PERIOD 0.1
+
+typedef struct
+{
+    int lev, lo, hi;
+    double t, rd, wr;
+} adapt_state;
+
+static void adapt_start(adapt_state *a, file_info *restrict fi, int lev, int lo, int hi)
+{
+    a->lev = lev < lo? lo : lev > hi? hi : lev;
+    a->lo = lo;
+    a->hi = hi;
+    a->t = now();
+    a->rd = fi->stats->read_time;
+    a->wr = fi->stats->write_time;
+}
+
+// The level to use from now on.
+static int adapt_level(adapt_state *a, file_info *restrict fi)
+{
+    double t = now(), total = t - a->t;
+    if (total < ADAPT_PERIOD)
+        return a->lev;
+
+    double rd = fi->stats->read_time - a->rd, wr = fi->stats->write_time - a->wr;
+    double busy = total - rd - wr;
+    if ((wr > busy / 2 || rd > busy) && a->lev < a->hi)
+        a->lev++;
+    else if (rd + wr < total / 10 && a->lev > a->lo)
+        a->lev--;
+    a->t = t;
+    a->rd += rd;
+    a->wr += wr;
+    return a->lev;
+}
+
+// For codecs that work in place and need their own copy anyway; short
+// only at EOF.
+ssize_t copy_input(int fd, file_info *restrict fi, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        const void *data;
+        ssize_t r = get_input(fd, fi, &data, (char*)buf + got, len - got);
+        if (r == -1)
+            return -1;
+        if (!r)
+            break;
+        if (data != (char*)buf + got)
+            memcpy((char*)buf + got, data, r);
+        got += r;
+    }
+    return got;
+}
+
 #ifdef HAVE_LIBBZ2
 static const char *bzerr(int e)
 {
@@ -93,10 +590,27 @@ static const char *bzerr(int e)
 
 #define ERRbz2(l,f) ERR(l,f,"%s", bzerr(ret))
 
-static int read_bz2(int in, int out, file_info *restrict fi, magic_t head)
+// Writes what's past the first *skip bytes.
+static int rewrite_skip(int fd, file_info *restrict fi, const char *buf, size_t len, unsigned long long *skip)
+{
+    if (*skip >= len)
+    {
+        *skip -= len;
+        return 0;
+    }
+    buf += *skip;
+    len -= *skip;
+    *skip = 0;
+    return write_out(fd, fi, buf, len);
+}
+
+static int read_bz2_serial(int in, int out, file_info *restrict fi, magic_t head,
+    unsigned long long skip)
 {
     bz_stream st;
     int ret;
+    ssize_t len;
+    const void *data;
     char inbuf[BUFFER_SIZE], outbuf[BUFFER_SIZE];
 
     bzero(&st, sizeof st);
@@ -105,16 +619,18 @@ static int read_bz2(int in, int out, file_info *restrict fi, magic_t head)
 
     if (head)
     {
-        if ((st.avail_in = read(in, inbuf + MLEN, sizeof inbuf - MLEN)) == -1)
+        if ((len = read_in(in, fi, inbuf + MLEN, sizeof inbuf - MLEN)) == -1)
             ERRlibc(fail, in);
-        st.avail_in += MLEN;
+        st.avail_in = len + MLEN;
         st.next_in = inbuf;
         U64(inbuf) = head;
         goto work;
     }
 
-    while ((st.avail_in = read(in, st.next_in = inbuf, sizeof inbuf)) > 0)
+    while ((len = get_input(in, fi, &data, inbuf, sizeof inbuf)) > 0)
     {
+        st.next_in = (char*)data;
+        st.avail_in = len;
 work:
         fi->sz += st.avail_in;
         do
@@ -131,12 +647,12 @@ work:
             if ((ret = BZ2_bzDecompress(&st)) && ret != BZ_STREAM_END)
                 ERRbz2(fail, in);
 
-            if (rewrite(out, outbuf, st.next_out - outbuf))
+            if (rewrite_skip(out, fi, outbuf, st.next_out - outbuf, &skip))
                 ERRlibc(fail, out);
             fi->sd += st.next_out - outbuf;
         } while (st.avail_in);
     }
-    if (st.avail_in)
+    if (len)
         ERRlibc(fail, in);
     if (ret == BZ_STREAM_END)
         goto ok;
@@ -148,7 +664,7 @@ work:
         st.avail_out = sizeof outbuf;
         ret = BZ2_bzDecompress(&st);
 
-        if (rewrite(out, outbuf, st.next_out - outbuf))
+        if (rewrite_skip(out, fi, outbuf, st.next_out - outbuf, &skip))
             ERRlibc(fail, out);
         fi->sd += st.next_out - outbuf;
     } while (!ret && !st.avail_out);
@@ -166,179 +682,1248 @@ end:
     return 1;
 }
 
-static int write_bz2(int in, int out, file_info *restrict fi, magic_t head)
+#define BZ2_BLOCK_MAGIC 0x314159265359ULL
+#define BZ2_EOS_MAGIC   0x177245385090ULL
+#define BZ2_MASK48      0xffffffffffffULL
+
+// Candidate magic starts: bit s of bz2_lut[b] means a block magic can
+// begin at bit s of the byte before a byte b, bit 8+s the same for an
+// end-of-stream magic.  That next byte lies fully within either magic.
+static uint16_t bz2_lut[256];
+
+static void bz2_init_lut(void)
 {
-    bz_stream st;
-    int ret;
-    char inbuf[BUFFER_SIZE], outbuf[BUFFER_SIZE];
+    for (int s = 0; s < 8; s++)
+    {
+        bz2_lut[BZ2_BLOCK_MAGIC >> (32 + s) & 0xff] |= 1 << s;
+        bz2_lut[BZ2_EOS_MAGIC >> (32 + s) & 0xff] |= 0x100 << s;
+    }
+}
 
-    bzero(&st, sizeof st);
-    if ((ret = BZ2_bzCompressInit(&st, level?:9, 0, 0)))
-        ERRbz2(end, in);
+// Up to 57 bits starting at a given bit; zero-padded past the end.
+static uint64_t bz2_bits(const uint8_t *data, size_t len, uint64_t bit, int n)
+{
+    uint64_t w = 0;
+    size_t p = bit / 8;
+    for (int i = 0; i < 8; i++)
+        w = w << 8 | (p + i < len? data[p + i] : 0);
+    return w >> (64 - n - bit % 8) & ((1ULL << n) - 1);
+}
+
+typedef struct
+{
+    const uint8_t       *data;
+    size_t              len, sstart;
+    uint64_t            bit;    // a magic, or the next stream's header
+    uint32_t            crc;
+    char                lvl;
+    bool                in_stream;
+} bz2_scan;
+
+// The first block or end-of-stream magic at or past a given bit.
+static uint64_t bz2_find(const bz2_scan *sc, uint64_t from)
+{
+    const uint8_t *data = sc->data;
+    uint64_t end = sc->len * 8;
 
-    while ((st.avail_in = read(in, st.next_in = inbuf, sizeof inbuf)) > 0)
+    for (size_t p = from / 8; p + 1 < sc->len; p++)
     {
-        fi->sd += st.avail_in;
-        do
+        uint16_t cand = bz2_lut[data[p + 1]];
+        if (!cand)
+            continue;
+        for (int s = 0; s < 8; s++)
         {
-            st.next_out  = outbuf;
-            st.avail_out = sizeof outbuf;
-            if ((ret = BZ2_bzCompress(&st, BZ_RUN)) && ret != BZ_RUN_OK)
-                ERRbz2(fail, in);
-
-            if (rewrite(out, outbuf, st.next_out - outbuf))
-                ERRlibc(fail, out);
-            fi->sz += st.next_out - outbuf;
-        } while (st.avail_in);
+            uint64_t bit = p * 8 + s;
+            if (!(cand & (0x101 << s)) || bit < from || bit + 48 > end)
+                continue;
+            uint64_t m = bz2_bits(data, sc->len, bit, 48);
+            if (m == BZ2_BLOCK_MAGIC || m == BZ2_EOS_MAGIC)
+                return bit;
+        }
     }
-    if (st.avail_in)
-        ERRlibc(fail, in);
+    return -1;
+}
 
-    // Flush the stream
-    do
-    {
-        st.next_out  = outbuf;
-        st.avail_out = sizeof outbuf;
-        ret = BZ2_bzCompress(&st, BZ_FINISH);
+// Splits the input into blocks at magics, checking what can be checked
+// without decoding.  Returns 1 for a block [*b, *e), 0 at the end of
+// input, -1 if something doesn't add up.
+static int bz2_next_block(bz2_scan *sc, uint64_t *b, uint64_t *e)
+{
+    uint64_t end = sc->len * 8;
 
-        if (rewrite(out, outbuf, st.next_out - outbuf))
-            ERRlibc(fail, out);
-        fi->sz += st.next_out - outbuf;
-    } while (ret == BZ_FINISH_OK);
-    if (ret != BZ_STREAM_END)
-        ERRbz2(fail, in);
-    BZ2_bzCompressEnd(&st);
-    return 0;
+    while (1)
+    {
+        if (!sc->in_stream)
+        {
+            size_t p = sc->bit / 8;
+            if (p == sc->len)
+                return 0;
+            sc->sstart = p;
+            if (sc->len - p < 4 || memcmp(sc->data + p, "BZh", 3)
+                || sc->data[p + 3] < '1' || sc->data[p + 3] > '9')
+            {
+                return -1;
+            }
+            sc->lvl = sc->data[p + 3];
+            sc->crc = 0;
+            sc->bit = (p + 4) * 8;
+            sc->in_stream = 1;
+        }
 
-fail:
-    BZ2_bzCompressEnd(&st);
-end:
-    return 1;
+        if (sc->bit + 80 > end)
+            return -1;
+        uint64_t m = bz2_bits(sc->data, sc->len, sc->bit, 48);
+        uint32_t crc = bz2_bits(sc->data, sc->len, sc->bit + 48, 32);
+        if (m == BZ2_EOS_MAGIC)
+        {
+            if (crc != sc->crc)
+                return -1;
+            sc->bit = (sc->bit + 80 + 7) & ~7ULL;
+            sc->in_stream = 0;
+            continue;
+        }
+        if (m != BZ2_BLOCK_MAGIC)
+            return -1;
+
+        *b = sc->bit;
+        *e = bz2_find(sc, sc->bit + 80);
+        if (*e == -1)
+            return -1;
+        sc->crc = (sc->crc << 1 | sc->crc >> 31) ^ crc;
+        sc->bit = *e;
+        return 1;
+    }
 }
-# undef ERRbz2
-#endif
 
-#ifdef HAVE_LIBZ
-static const char *gzerr(int e)
+typedef struct
 {
-    switch (e)
+    worker      w;
+    uint8_t     *zbuf;
+    char        *dbuf;
+    size_t      zlen, zsize, dlen, dsize, sstart;
+    int         ret;
+    bool        full;
+} bz2_block;
+
+static void bz2_put_bits(uint8_t *buf, uint64_t *pos, uint64_t v, int n)
+{
+    while (n--)
     {
-    case Z_NEED_DICT:
-        return "file compressed with a private dictionary";
-    case Z_ERRNO:
-        return strerror(errno);
-    case Z_STREAM_ERROR:
-        return "internal error";
-    case Z_DATA_ERROR:
-        return "file is corrupted";
-    case Z_MEM_ERROR:
-        return "out of memory";
-    case Z_BUF_ERROR:
-        return "unexpected end of file";
-    case Z_VERSION_ERROR:
-        return "unsupported version of gzip";
-    default:
-        return "invalid error?!?";
+        if (v >> n & 1)
+            buf[*pos / 8] |= 0x80 >> *pos % 8;
+        (*pos)++;
     }
 }
 
-#define ERRgz(l,f) ERR(l,f,"%s", gzerr(ret))
+// Wraps a lone block into a stream of its own, as bzip2recover does:
+// header, the block re-aligned to a byte, an end-of-stream magic and a
+// combined CRC which for one block equals the block's CRC.
+static bool bz2_wrap_block(bz2_block *job, const bz2_scan *sc, uint64_t b, uint64_t e)
+{
+    uint64_t nbits = e - b;
+    size_t need = 4 + nbits / 8 + 12;
 
-static int read_gz(int in, int out, file_info *restrict fi, magic_t head)
+    if (need > job->zsize)
+    {
+        free(job->zbuf);
+        if (!(job->zbuf = malloc(job->zsize = need)))
+            return 0;
+    }
+    uint8_t *z = job->zbuf;
+    memcpy(z, "BZh", 3);
+    z[3] = sc->lvl;
+    z += 4;
+
+    const uint8_t *d = sc->data + b / 8;
+    int r = b % 8;
+    for (size_t k = 0; k < nbits / 8; k++)
+        z[k] = r? d[k] << r | d[k + 1] >> (8 - r) : d[k];
+    bzero(z + nbits / 8, 12);
+    if (nbits % 8)
+        z[nbits / 8] = bz2_bits(sc->data, sc->len, e - nbits % 8, nbits % 8) << (8 - nbits % 8);
+
+    bz2_put_bits(z, &nbits, BZ2_EOS_MAGIC, 48);
+    bz2_put_bits(z, &nbits, bz2_bits(sc->data, sc->len, b + 48, 32), 32);
+    job->zlen = 4 + (nbits + 7) / 8;
+    return 1;
+}
+
+static void bz2_decode_job(worker *w)
 {
-    z_stream st;
-    int ret = 0;
-    ssize_t len;
-    Bytef inbuf[BUFFER_SIZE], outbuf[BUFFER_SIZE];
+    bz2_block *job = (bz2_block*)w;
+    bz_stream st;
 
     bzero(&st, sizeof st);
-    if (inflateInit2(&st, 32))
-        ERRoom(end, in);
+    if ((job->ret = BZ2_bzDecompressInit(&st, 0, 0)))
+        return;
+    st.next_in  = (char*)job->zbuf;
+    st.avail_in = job->zlen;
+    job->dlen = 0;
+    do
+    {
+        if (job->dlen == job->dsize)
+        {
+            char *buf = realloc(job->dbuf, job->dsize = job->dsize * 2 ?: 1*MB);
+            if (!buf)
+            {
+                job->ret = BZ_MEM_ERROR;
+                break;
+            }
+            job->dbuf = buf;
+        }
+        st.next_out  = job->dbuf + job->dlen;
+        st.avail_out = job->dsize - job->dlen;
+        job->ret = BZ2_bzDecompress(&st);
+        job->dlen = st.next_out - job->dbuf;
+    } while (job->ret == BZ_OK && (st.avail_in || !st.avail_out));
+    if (job->ret == BZ_STREAM_END)
+        job->ret = 0;
+    else if (job->ret == BZ_OK)
+        job->ret = BZ_UNEXPECTED_EOF;
+    BZ2_bzDecompressEnd(&st);
+}
 
-    if (head)
+static void free_bz2_blocks(bz2_block *jobs, int n)
+{
+    for (int i = 0; i < n; i++)
     {
-        if ((len = read(in, inbuf + MLEN, sizeof inbuf - MLEN)) == -1)
-            ERRlibc(fail, in);
-        st.avail_in = len + MLEN;
-        st.next_in = inbuf;
-        U64(inbuf) = head;
-        goto work;
+        worker_stop(&jobs[i].w);
+        free(jobs[i].zbuf);
+        free(jobs[i].dbuf);
     }
+    free(jobs);
+}
+
+// lbzip2-style: a bzip2 block can't be found without scanning bits, but
+// once found it decodes independently.  Needs the whole input mapped, and
+// on any inconsistency the stream in question is redone serially --
+// skipping what was already written -- so a magic that happens to occur
+// inside compressed data costs only time.  Returns -1 if not applicable.
+static int read_bz2_mt(int in, int out, file_info *restrict fi, magic_t head)
+{
+    const uint8_t *map = fi->map;
+    size_t map_len = fi->map_len;
+    off_t base = fi->in_pos;
 
-    while ((len = read(in, st.next_in = inbuf, sizeof inbuf)) > 0)
+    if (!map)
     {
-        st.avail_in = len;
-work:
-        fi->sz += st.avail_in;
-        do
+        struct stat sb;
+        if (fstat(in, &sb) || !S_ISREG(sb.st_mode))
+            return -1;
+        base = lseek(in, 0, SEEK_CUR);
+        if (base < MLEN || sb.st_size <= base)
+            return -1;
+        base -= MLEN;
+        map_len = sb.st_size;
+        if ((map = mmap(0, map_len, PROT_READ, MAP_PRIVATE, in, 0)) == MAP_FAILED)
+            return -1;
+        madvise((void*)map, map_len, MADV_SEQUENTIAL);
+    }
+
+    static pthread_once_t lut_once = PTHREAD_ONCE_INIT;
+    pthread_once(&lut_once, bz2_init_lut);
+
+    bz2_scan sc = {map + base, map_len - base};
+    // a block takes ~4MB to decode plus its output, up to 45MB
+    int n = threads, busy = 0, err = 1;
+    if (memlimit && memlimit / (8*MB) < n)
+        n = memlimit / (8*MB) ?: 1;
+    bool eof = 0, fallback = 0, drop = 0;
+    size_t fb_start = 0, cur_sstart = -1;
+    unsigned long long written = 0;
+    bz2_block *jobs = calloc(n, sizeof(bz2_block));
+
+    if (!jobs)
+        ERRoom(end, in);
+
+    for (int i = 0; !eof || busy; i = (i + 1) % n)
+    {
+        bz2_block *job = &jobs[i];
+
+        if (job->full)
+        {
+            worker_wait(&job->w);
+            busy--;
+            job->full = 0;
+            if (drop)
+                continue;
+            if (job->ret)
+            {
+                // drop everything after it
+                fallback = drop = eof = 1;
+                fb_start = job->sstart;
+                continue;
+            }
+            if (job->sstart != cur_sstart)
+            {
+                cur_sstart = job->sstart;
+                written = 0;
+            }
+            if (write_out(out, fi, job->dbuf, job->dlen))
+                ERRlibc(fail, out);
+            written += job->dlen;
+            fi->sd += job->dlen;
+        }
+        if (eof)
+            continue;
+
+        uint64_t b, e;
+        int r = bz2_next_block(&sc, &b, &e);
+        if (r <= 0)
+        {
+            eof = 1;
+            if (r)
+            {
+                fallback = 1;
+                fb_start = sc.sstart;
+            }
+            continue;
+        }
+
+        if (!job->w.started && !worker_start(&job->w, bz2_decode_job))
+            ERRlibc(fail, in);
+        if (!bz2_wrap_block(job, &sc, b, e))
+            ERRoom(fail, in);
+        job->sstart = sc.sstart;
+        job->full = 1;
+        worker_run(&job->w);
+        busy++;
+    }
+
+    if (fallback)
+    {
+        unsigned long long skip = fb_start == cur_sstart? written : 0;
+        fi->sd -= skip; // will be counted again
+        fi->sz = fb_start;
+        if (fi->map)
+            fi->in_pos = base + fb_start;
+        else if (lseek(in, base + fb_start, SEEK_SET) == -1)
+            ERRlibc(fail, in);
+        free_bz2_blocks(jobs, n);
+        if (map != fi->map)
+            munmap((void*)map, map_len);
+        return read_bz2_serial(in, out, fi, 0, skip);
+    }
+    fi->sz = sc.len;
+    err = 0;
+
+fail:
+    free_bz2_blocks(jobs, n);
+end:
+    if (map != fi->map)
+        munmap((void*)map, map_len);
+    return err;
+}
+
+static int read_bz2(int in, int out, file_info *restrict fi, magic_t head)
+{
+    if (threads > 1)
+    {
+        int ret = read_bz2_mt(in, out, fi, head);
+        if (ret != -1)
+            return ret;
+    }
+    return read_bz2_serial(in, out, fi, head, 0);
+}
+
+typedef struct
+{
+    worker      w;
+    char        *inbuf, *outbuf;
+    const char  *in; // inbuf, or straight into the input mapping
+    unsigned    len, zlen;
+    int         ret;
+    bool        full;
+} bz2_job;
+
+static void bz2_compress_job(worker *w)
+{
+    bz2_job *job = (bz2_job*)w;
+    job->zlen = job->len + job->len / 100 + 600; // bound from the manual
+    job->ret = BZ2_bzBuffToBuffCompress(job->outbuf, &job->zlen,
+        (char*)job->in, job->len, level?:9, 0, 0);
+}
+
+static void free_bz2_jobs(bz2_job *jobs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        worker_stop(&jobs[i].w);
+        free(jobs[i].inbuf);
+        free(jobs[i].outbuf);
+    }
+    free(jobs);
+}
+
+// Every chunk becomes a whole bzip2 stream; concatenated streams are
+// valid bzip2 for any decoder, read_bz2() included.
+static int write_bz2_mt(int in, int out, file_info *restrict fi)
+{
+    int n = threads, busy = 0, ret, err = 1;
+    bool eof = 0;
+    // a block's worth at the chosen level
+    size_t chunk = block_size?: (level?:9) * 100000;
+    if (chunk > UINT_MAX / 2)
+        chunk = UINT_MAX / 2;
+    bz2_job *jobs = calloc(n, sizeof(bz2_job));
+
+    if (!jobs)
+        ERRoom(end, in);
+
+    for (int i = 0; !eof || busy; i = (i + 1) % n)
+    {
+        bz2_job *job = &jobs[i];
+
+        if (job->full)
+        {
+            worker_wait(&job->w);
+            busy--;
+            if ((ret = job->ret))
+                ERRbz2(fail, in);
+            if (write_out(out, fi, job->outbuf, job->zlen))
+                ERRlibc(fail, out);
+            fi->sz += job->zlen;
+            job->full = 0;
+        }
+        if (eof)
+            continue;
+
+        if (!job->w.started)
+        {
+            if (!fi->map && !(job->inbuf = malloc(chunk)))
+                ERRoom(fail, in);
+            if (!(job->outbuf = malloc(chunk + chunk / 100 + 600)))
+                ERRoom(fail, in);
+            if (!worker_start(&job->w, bz2_compress_job))
+                ERRlibc(fail, in);
+        }
+
+        ssize_t len = get_input(in, fi, (const void**)&job->in, job->inbuf, chunk);
+        if (len == -1)
+            ERRlibc(fail, in);
+        // an empty file still needs a stream; a hole may come short
+        if (!len)
+            eof = 1;
+        if (!len && fi->sd)
+            continue;
+        job->len = len;
+        job->full = 1;
+        fi->sd += len;
+        worker_run(&job->w);
+        busy++;
+    }
+    err = 0;
+
+fail:
+    free_bz2_jobs(jobs, n);
+end:
+    return err;
+}
+
+static int write_bz2(int in, int out, file_info *restrict fi, magic_t head)
+{
+    bz_stream st;
+    int ret;
+    ssize_t len;
+    const void *data;
+    char inbuf[BUFFER_SIZE], outbuf[BUFFER_SIZE];
+
+    if (threads > 1)
+        return write_bz2_mt(in, out, fi);
+
+    bzero(&st, sizeof st);
+    if ((ret = BZ2_bzCompressInit(&st, level?:9, 0, 0)))
+        ERRbz2(end, in);
+
+    while ((len = get_input(in, fi, &data, inbuf, sizeof inbuf)) > 0)
+    {
+        st.next_in = (char*)data;
+        st.avail_in = len;
+        fi->sd += len;
+        do
+        {
+            st.next_out  = outbuf;
+            st.avail_out = sizeof outbuf;
+            if ((ret = BZ2_bzCompress(&st, BZ_RUN)) && ret != BZ_RUN_OK)
+                ERRbz2(fail, in);
+
+            if (write_out(out, fi, outbuf, st.next_out - outbuf))
+                ERRlibc(fail, out);
+            fi->sz += st.next_out - outbuf;
+        } while (st.avail_in);
+    }
+    if (len)
+        ERRlibc(fail, in);
+
+    // Flush the stream
+    do
+    {
+        st.next_out  = outbuf;
+        st.avail_out = sizeof outbuf;
+        ret = BZ2_bzCompress(&st, BZ_FINISH);
+
+        if (write_out(out, fi, outbuf, st.next_out - outbuf))
+            ERRlibc(fail, out);
+        fi->sz += st.next_out - outbuf;
+    } while (ret == BZ_FINISH_OK);
+    if (ret != BZ_STREAM_END)
+        ERRbz2(fail, in);
+    BZ2_bzCompressEnd(&st);
+    return 0;
+
+fail:
+    BZ2_bzCompressEnd(&st);
+end:
+    return 1;
+}
+# undef ERRbz2
+#endif
+
+#ifdef HAVE_LIBZ
+static const char *gzerr(int e)
+{
+    switch (e)
+    {
+    case Z_NEED_DICT:
+        return "file compressed with a private dictionary";
+    case Z_ERRNO:
+        return strerror(errno);
+    case Z_STREAM_ERROR:
+        return "internal error";
+    case Z_DATA_ERROR:
+        return "file is corrupted";
+    case Z_MEM_ERROR:
+        return "out of memory";
+    case Z_BUF_ERROR:
+        return "unexpected end of file";
+    case Z_VERSION_ERROR:
+        return "unsupported version of gzip";
+    default:
+        return "invalid error?!?";
+    }
+}
+
+#define ERRgz(l,f) ERR(l,f,"%s", gzerr(ret))
+
+#define GZ_WINDOW 32768
+
+// --build-index: zran-style access points, each where a deflate block
+// starts: the offset in both streams, the bits of the byte before that
+// belong to it, and the 32KB window before (itself deflated).  Stored
+// beside the .gz as:
+//   magic, gz size, span, count, then per point: out, in, bits, wlen, window
+#define GZ_INDEX_EXT ".gzidx"
+#define GZ_INDEX_MAGIC "zstgzix1"
+#define GZ_INDEX_HEAD (8 + 8 + 8 + 4)
+#define GZ_POINT_HEAD (8 + 8 + 1 + 4)
+
+typedef struct
+{
+    uint64_t out, in;
+    uint8_t bits;
+    uint32_t wlen;
+    uint8_t *win;
+} gz_point;
+
+typedef struct
+{
+    uint64_t gz_size;
+    uint32_t n;
+    gz_point *p;
+} gz_index;
+
+static void free_gz_index(gz_index *ix)
+{
+    for (uint32_t i = 0; i < ix->n; i++)
+        free(ix->p[i].win);
+    free(ix->p);
+}
+
+static char *gz_index_path(file_info *restrict fi)
+{
+    char *path;
+    return asprintf(&path, "%s%s%s", fi->path, fi->name_in, GZ_INDEX_EXT) == -1? 0 : path;
+}
+
+static int add_point(gz_index *ix, z_stream *st, uint64_t out, uint64_t in, int bits)
+{
+    Bytef win[GZ_WINDOW];
+    uInt wlen = sizeof win;
+    if (!(ix->n & (ix->n - 1)))
+    {
+        void *p = realloc(ix->p, (ix->n? ix->n * 2 : 1) * sizeof *ix->p);
+        if (!p)
+            return -1;
+        ix->p = p;
+    }
+    gz_point *pt = &ix->p[ix->n];
+    if (inflateGetDictionary(st, win, &wlen) != Z_OK)
+        return -1;
+    uLongf zlen = compressBound(wlen);
+    if (!(pt->win = malloc(zlen)))
+        return -1;
+    if (compress2(pt->win, &zlen, win, wlen, 9) != Z_OK)
+    {
+        free(pt->win);
+        return -1;
+    }
+    pt->out = out;
+    pt->in = in;
+    pt->bits = bits;
+    pt->wlen = zlen;
+    ix->n++;
+    return 0;
+}
+
+static int write_gz_index(gz_index *ix, uint64_t span, file_info *restrict fi)
+{
+    uint8_t buf[GZ_INDEX_HEAD > GZ_POINT_HEAD? GZ_INDEX_HEAD : GZ_POINT_HEAD];
+    char *path = gz_index_path(fi);
+    int fd = path? open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666) : -1;
+    if (fd == -1)
+    {
+        fprintf(stderr, "%s: %s: %m\n", exe, path?: fi->name_in);
+        free(path);
+        return 1;
+    }
+
+    memcpy(buf, GZ_INDEX_MAGIC, 8);
+    put_le64(buf + 8, ix->gz_size);
+    put_le64(buf + 16, span);
+    put_le32(buf + 24, ix->n);
+    int err = rewrite(fd, buf, GZ_INDEX_HEAD);
+    for (uint32_t i = 0; i < ix->n && !err; i++)
+    {
+        put_le64(buf, ix->p[i].out);
+        put_le64(buf + 8, ix->p[i].in);
+        buf[16] = ix->p[i].bits;
+        put_le32(buf + 17, ix->p[i].wlen);
+        err = rewrite(fd, buf, GZ_POINT_HEAD) || rewrite(fd, ix->p[i].win, ix->p[i].wlen);
+    }
+    if (close(fd))
+        err = 1;
+    if (err)
+    {
+        fprintf(stderr, "%s: %s: %m\n", exe, path);
+        unlink(path);
+    }
+    free(path);
+    return err;
+}
+
+static int read_gz_index(gz_index *ix, file_info *restrict fi)
+{
+    uint8_t buf[GZ_INDEX_HEAD];
+    char *path = gz_index_path(fi);
+    FILE *f = path? fopen(path, "re") : 0;
+    if (!f)
+    {
+        if (path && errno == ENOENT)
+            fprintf(stderr, "%s: %s: no index, make one with --build-index\n", exe, path);
+        else
+            fprintf(stderr, "%s: %s: %m\n", exe, path?: fi->name_in);
+        free(path);
+        return 1;
+    }
+
+    if (fread(buf, GZ_INDEX_HEAD, 1, f) != 1 || memcmp(buf, GZ_INDEX_MAGIC, 8))
+        goto bad;
+    ix->gz_size = get_le64(buf + 8);
+    uint32_t n = get_le32(buf + 24);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (!(ix->n & (ix->n - 1)))
+        {
+            void *p = realloc(ix->p, (ix->n? ix->n * 2 : 1) * sizeof *ix->p);
+            if (!p)
+                goto bad;
+            ix->p = p;
+        }
+        gz_point *pt = &ix->p[ix->n];
+        if (fread(buf, GZ_POINT_HEAD, 1, f) != 1)
+            goto bad;
+        pt->out = get_le64(buf);
+        pt->in = get_le64(buf + 8);
+        pt->bits = buf[16];
+        pt->wlen = get_le32(buf + 17);
+        if (pt->bits > 7 || pt->wlen > compressBound(GZ_WINDOW) || !(pt->win = malloc(pt->wlen?: 1)))
+            goto bad;
+        ix->n++;
+        if (fread(pt->win, pt->wlen, 1, f) != 1 && pt->wlen)
+            goto bad;
+    }
+    fclose(f);
+    free(path);
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: %s: corrupted index\n", exe, path);
+    fclose(f);
+    free(path);
+    return 1;
+}
+
+// Inflates the whole file once, noting a point every span bytes of output.
+static int gz_build_index(int in, file_info *restrict fi, magic_t head)
+{
+    z_stream st;
+    int ret = 0, err = 1;
+    bool ended = 0;
+    gz_index ix = {0};
+    uint64_t last = 0;
+    Bytef inbuf[BUFFER_SIZE], outbuf[BUFFER_SIZE];
+    struct stat sb;
+
+    bzero(&st, sizeof st);
+    if (!in || fstat(in, &sb) || !S_ISREG(sb.st_mode))
+        ERR(end, in, "--build-index needs a regular file");
+    ix.gz_size = sb.st_size;
+    if (inflateInit2(&st, 31))
+        ERRoom(end, in);
+
+    for (;;)
+    {
+        if (!st.avail_in)
+        {
+            size_t got = head? MLEN : 0;
+            U64(inbuf) = head;
+            ssize_t len = read_in(in, fi, inbuf + got, sizeof inbuf - got);
+            if (len == -1)
+                ERRlibc(fail, in);
+            if (!(got += len))
+                break;
+            st.next_in = inbuf;
+            st.avail_in = got;
+            fi->sz += got;
+            head = 0;
+        }
+        if (ended) // another member follows
+        {
+            if ((ret = inflateReset(&st)))
+                ERRgz(fail, in);
+            ended = 0;
+        }
+
+        st.next_out = outbuf;
+        st.avail_out = sizeof outbuf;
+        ret = inflate(&st, Z_BLOCK);
+        fi->sd += st.next_out - outbuf;
+        if (ret == Z_STREAM_END)
+            ended = 1;
+        else if (ret && ret != Z_BUF_ERROR)
+            ERRgz(fail, in);
+        // at the start of a block, but not past the last one
+        else if ((st.data_type & 192) == 128 && (!ix.n || fi->sd - last >= index_span))
+        {
+            if (add_point(&ix, &st, fi->sd, fi->sz - st.avail_in, st.data_type & 7))
+                ERRoom(fail, in);
+            last = fi->sd;
+        }
+    }
+    if (!ended)
+        ERRueof(fail, in);
+    err = write_gz_index(&ix, index_span, fi);
+
+fail:
+    inflateEnd(&st);
+end:
+    free_gz_index(&ix);
+    return err;
+}
+
+// --range: start inflating at the last point before the offset.
+static int read_gz_range(int in, int out, file_info *restrict fi)
+{
+    z_stream st;
+    int ret = 0, err = 1;
+    gz_index ix = {0};
+    Bytef inbuf[BUFFER_SIZE], outbuf[BUFFER_SIZE], win[GZ_WINDOW];
+    struct stat sb;
+
+    bzero(&st, sizeof st);
+    if (fstat(in, &sb) || !S_ISREG(sb.st_mode))
+        ERR(end, in, "--range needs a regular file");
+    if (read_gz_index(&ix, fi))
+        goto end;
+    if (ix.gz_size != sb.st_size)
+        ERR(end, in, "index is stale, rebuild it with --build-index");
+    if (!ix.n)
+    {
+        err = 0; // nothing in there
+        goto end;
+    }
+
+    uint32_t i = ix.n;
+    while (--i && ix.p[i].out > range_off)
+        ;
+    gz_point *pt = &ix.p[i];
+    if (inflateInit2(&st, -15))
+        ERRoom(end, in);
+    if (lseek(in, pt->in - !!pt->bits, SEEK_SET) == -1)
+        ERRlibc(fail, in);
+    if (fi->stats)
+        fi->stats->seeks++;
+    if (pt->bits)
+    {
+        uint8_t c;
+        if (read_in(in, fi, &c, 1) != 1)
+            ERRueof(fail, in);
+        inflatePrime(&st, pt->bits, c >> (8 - pt->bits));
+    }
+    uLongf wlen = sizeof win;
+    if (uncompress(win, &wlen, pt->win, pt->wlen) != Z_OK
+        || inflateSetDictionary(&st, win, wlen) != Z_OK)
+        ERR(fail, in, "corrupted index");
+
+    unsigned long long skip = range_off - pt->out, left = range_len;
+    ssize_t len = 0;
+    unsigned trailer = 8;
+    while (left && (len = read_in(in, fi, inbuf, sizeof inbuf)) > 0)
+    {
+        st.next_in = inbuf;
+        st.avail_in = len;
+        fi->sz += len;
+        while (st.avail_in && left)
+        {
+            // Points may lie in any member.  Going on to the next, the
+            // raw stream's trailer is skipped; later ones are gzip all along.
+            if (ret == Z_STREAM_END)
+            {
+                size_t t = st.avail_in < trailer? st.avail_in : trailer;
+                st.next_in += t;
+                st.avail_in -= t;
+                if ((trailer -= t) || !st.avail_in)
+                    continue;
+                if ((ret = inflateReset2(&st, 31)))
+                    ERRgz(fail, in);
+            }
+            st.next_out = outbuf;
+            st.avail_out = sizeof outbuf;
+            if ((ret = inflate(&st, Z_NO_FLUSH)) && ret != Z_STREAM_END)
+                ERRgz(fail, in);
+            size_t got = st.next_out - outbuf, from = skip < got? skip : got;
+            skip -= from;
+            got -= from;
+            if (got > left)
+                got = left;
+            if (write_out(out, fi, outbuf + from, got))
+                ERRlibc(fail, out);
+            fi->sd += got;
+            left -= got;
+        }
+    }
+    if (left && len == -1)
+        ERRlibc(fail, in);
+    err = 0;
+
+fail:
+    inflateEnd(&st);
+end:
+    free_gz_index(&ix);
+    return err;
+}
+
+// zlib checks that a z_stream stays where it was set up, so the pooled
+// ones live on the heap.
+static __thread z_stream *spare_deflate, *spare_inflate;
+
+static z_stream *deflate_take(int lev)
+{
+    z_stream *st = spare_deflate;
+    spare_deflate = 0;
+    if (st && !deflateReset(st) && !deflateParams(st, lev, Z_DEFAULT_STRATEGY))
+        return st;
+    if (st)
+        deflateEnd(st);
+    else if (!(st = malloc(sizeof(z_stream))))
+        return 0;
+    bzero(st, sizeof(z_stream));
+    if (deflateInit2(st, lev, Z_DEFLATED, 31, 9, 0))
+    {
+        free(st);
+        return 0;
+    }
+    return st;
+}
+
+static void deflate_give(z_stream *st)
+{
+    if (!spare_deflate)
+        spare_deflate = st;
+    else
+    {
+        deflateEnd(st);
+        free(st);
+    }
+}
+
+static z_stream *inflate_take(int wbits)
+{
+    z_stream *st = spare_inflate;
+    spare_inflate = 0;
+    if (st && !inflateReset2(st, wbits))
+        return st;
+    if (st)
+        inflateEnd(st);
+    else if (!(st = malloc(sizeof(z_stream))))
+        return 0;
+    bzero(st, sizeof(z_stream));
+    if (inflateInit2(st, wbits))
+    {
+        free(st);
+        return 0;
+    }
+    return st;
+}
+
+static void inflate_give(z_stream *st)
+{
+    if (!spare_inflate)
+        spare_inflate = st;
+    else
+    {
+        inflateEnd(st);
+        free(st);
+    }
+}
+
+static int read_gz(int in, int out, file_info *restrict fi, magic_t head)
+{
+    z_stream *st;
+    int ret = 0;
+    ssize_t len;
+    const void *data;
+    Bytef inbuf[BUFFER_SIZE], outbuf[BUFFER_SIZE];
+
+    if (index_span)
+        return gz_build_index(in, fi, head);
+    if (range_len)
+        return read_gz_range(in, out, fi);
+
+    if (!(st = inflate_take(32)))
+        ERRoom(end, in);
+
+    if (head)
+    {
+        if ((len = read_in(in, fi, inbuf + MLEN, sizeof inbuf - MLEN)) == -1)
+            ERRlibc(fail, in);
+        st->avail_in = len + MLEN;
+        st->next_in = inbuf;
+        U64(inbuf) = head;
+        goto work;
+    }
+
+    while ((len = get_input(in, fi, &data, inbuf, sizeof inbuf)) > 0)
+    {
+        st->next_in = (Bytef*)data;
+        st->avail_in = len;
+work:
+        fi->sz += st->avail_in;
+        do
         {
             // concatenated stream => reset stream
             if (ret == Z_STREAM_END)
-                if (ret = inflateReset(&st))
+                if (ret = inflateReset(st))
                     ERRgz(fail, in);
 
-            st.next_out  = outbuf;
-            st.avail_out = sizeof outbuf;
-            if ((ret = inflate(&st, Z_NO_FLUSH)) && ret != Z_STREAM_END)
+            st->next_out  = outbuf;
+            st->avail_out = sizeof outbuf;
+            if ((ret = inflate(st, Z_NO_FLUSH)) && ret != Z_STREAM_END)
                 ERRgz(fail, in);
 
-            if (rewrite(out, outbuf, st.next_out - outbuf))
+            if (write_out(out, fi, outbuf, st->next_out - outbuf))
                 ERRlibc(fail, out);
-            fi->sd += st.next_out - outbuf;
+            fi->sd += st->next_out - outbuf;
 
-        } while (st.avail_in);
+        } while (st->avail_in);
     }
-    if (st.avail_in)
+    if (len)
         ERRlibc(fail, in);
 
     // Flush the stream
     do
     {
-        st.next_out  = outbuf;
-        st.avail_out = sizeof outbuf;
-        ret = inflate(&st, Z_FINISH);
+        st->next_out  = outbuf;
+        st->avail_out = sizeof outbuf;
+        ret = inflate(st, Z_FINISH);
 
-        if (rewrite(out, outbuf, st.next_out - outbuf))
+        if (write_out(out, fi, outbuf, st->next_out - outbuf))
             ERRlibc(fail, out);
-        fi->sd += st.next_out - outbuf;
+        fi->sd += st->next_out - outbuf;
     } while (!ret);
     if (ret != Z_STREAM_END)
         ERRgz(fail, in);
-    inflateEnd(&st);
+    inflate_give(st);
     return 0;
 
 fail:
-    inflateEnd(&st);
+    inflate_give(st);
+end:
+    return 1;
+}
+
+// -l: as gzip does, trust the trailer of the last member, which gives
+// the size mod 4GB -- and of that member only.
+static int list_gz(int in, file_info *restrict fi)
+{
+    uint8_t isize[4];
+    if (fi->sz < 18)
+        ERRueof(end, in);
+    if (pread_in(in, fi, isize, sizeof isize, fi->sz - sizeof isize))
+        ERRlibc(end, in);
+    fi->sd = get_le32(isize);
+    return 0;
+
 end:
     return 1;
 }
 
+#define GZ_CHUNK (128*KB)
+
+typedef struct
+{
+    worker      w;
+    z_stream    st;
+    Bytef       *inbuf, *outbuf, dict[GZ_WINDOW];
+    const Bytef *in; // inbuf, or straight into the input mapping
+    size_t      len, dictlen, zlen, zsize;
+    uLong       crc;
+    int         ret;
+    bool        full;
+} gz_job;
+
+// A chunk ends on a byte boundary with an empty stored block; the
+// stream's final block is added by the caller.
+static void deflate_job(worker *w)
+{
+    gz_job *job = (gz_job*)w;
+    z_stream *st = &job->st;
+
+    job->crc = crc32(0, job->in, job->len);
+    if ((job->ret = deflateReset(st)))
+        return;
+    if (job->dictlen && (job->ret = deflateSetDictionary(st, job->dict, job->dictlen)))
+        return;
+
+    st->next_in  = (Bytef*)job->in;
+    st->avail_in = job->len;
+    job->zlen = 0;
+    do
+    {
+        if (job->zlen == job->zsize)
+        {
+            Bytef *buf = realloc(job->outbuf, job->zsize *= 2);
+            if (!buf)
+            {
+                job->ret = Z_MEM_ERROR;
+                return;
+            }
+            job->outbuf = buf;
+        }
+        st->next_out  = job->outbuf + job->zlen;
+        st->avail_out = job->zsize - job->zlen;
+        job->ret = deflate(st, Z_SYNC_FLUSH);
+        job->zlen = st->next_out - job->outbuf;
+    } while (!job->ret && !st->avail_out);
+}
+
+static void free_gz_jobs(gz_job *jobs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        worker_stop(&jobs[i].w);
+        if (jobs[i].st.state)
+            deflateEnd(&jobs[i].st);
+        free(jobs[i].inbuf);
+        free(jobs[i].outbuf);
+    }
+    free(jobs);
+}
+
+// pigz-style: chunks are deflated independently but primed with the
+// previous 32KB as a dictionary, then spliced into a single member.
+// The output depends on the chunk size but not the thread count.
+static int write_gz_mt(int in, int out, file_info *restrict fi)
+{
+    int n = threads, busy = 0, ret = 0, err = 1;
+    bool eof = 0;
+    size_t chunk = block_size?: GZ_CHUNK;
+    if (chunk < GZ_WINDOW)
+        chunk = GZ_WINDOW;
+    uLong crc = crc32(0, 0, 0);
+    unsigned long long isize = 0;
+    gz_job *jobs = calloc(n, sizeof(gz_job));
+
+    if (!jobs)
+        ERRoom(end, in);
+
+    // same as what zlib writes: no name, no mtime, OS = Unix
+    int lev = level?:6;
+    Bytef header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, lev == 9? 2 : lev == 1? 4 : 0, 3};
+    if (write_out(out, fi, header, sizeof header))
+        ERRlibc(fail, out);
+    fi->sz += sizeof header;
+
+    for (int i = 0, prev = n - 1; !eof || busy; prev = i, i = (i + 1) % n)
+    {
+        gz_job *job = &jobs[i];
+
+        if (job->full)
+        {
+            worker_wait(&job->w);
+            busy--;
+            if ((ret = job->ret))
+                ERRgz(fail, in);
+            if (write_out(out, fi, job->outbuf, job->zlen))
+                ERRlibc(fail, out);
+            fi->sz += job->zlen;
+            crc = crc32_combine(crc, job->crc, job->len);
+            job->full = 0;
+        }
+        if (eof)
+            continue;
+
+        if (!job->w.started)
+        {
+            job->zsize = chunk + chunk / 8 + 64;
+            if ((ret = deflateInit2(&job->st, lev, Z_DEFLATED, -15, 9, 0)))
+                ERRgz(fail, in);
+            if (!fi->map && !(job->inbuf = malloc(chunk)))
+                ERRoom(fail, in);
+            if (!(job->outbuf = malloc(job->zsize)))
+                ERRoom(fail, in);
+            if (!worker_start(&job->w, deflate_job))
+                ERRlibc(fail, in);
+        }
+
+        ssize_t len = get_input(in, fi, (const void**)&job->in, job->inbuf, chunk);
+        if (len == -1)
+            ERRlibc(fail, in);
+        if (!len)
+        {
+            eof = 1;
+            continue;
+        }
+
+        // the previous chunk can't have been reused yet
+        job->dictlen = 0;
+        if (isize)
+        {
+            gz_job *pj = &jobs[prev];
+            job->dictlen = pj->len < GZ_WINDOW? pj->len : GZ_WINDOW;
+            memcpy(job->dict, pj->in + pj->len - job->dictlen, job->dictlen);
+        }
+        job->len = len;
+        job->full = 1;
+        isize += len;
+        fi->sd += len;
+        worker_run(&job->w);
+        busy++;
+    }
+
+    // an empty final block, then the trailer
+    Bytef trailer[10] = {3, 0};
+    put_le32(trailer + 2, crc);
+    put_le32(trailer + 6, isize);
+    if (write_out(out, fi, trailer, sizeof trailer))
+        ERRlibc(fail, out);
+    fi->sz += sizeof trailer;
+    err = 0;
+
+fail:
+    free_gz_jobs(jobs, n);
+end:
+    return err;
+}
+
+// pigz's rolling hash: a boundary every ~4KB, depending only on the
+// last few bytes, so an edit resyncs soon after.
+#define RSYNC_BITS 12
+#define RSYNC_MASK ((1U << RSYNC_BITS) - 1)
+#define RSYNC_HIT (RSYNC_MASK >> 1)
+
+// Bytes up to and including the next boundary, or len if there's none.
+static size_t rsync_scan(unsigned *hash, const Bytef *buf, size_t len, bool *hit)
+{
+    unsigned h = *hash;
+    for (size_t i = 0; i < len; i++)
+        if ((h = ((h << 1) ^ buf[i]) & RSYNC_MASK) == RSYNC_HIT)
+        {
+            *hash = h;
+            *hit = 1;
+            return i + 1;
+        }
+    *hash = h;
+    *hit = 0;
+    return len;
+}
+
 static int write_gz(int in, int out, file_info *restrict fi, magic_t head)
 {
-    z_stream st;
+    z_stream *st;
     int ret;
     ssize_t len;
+    unsigned hash = 0;
+    const void *data;
     Bytef inbuf[BUFFER_SIZE], outbuf[BUFFER_SIZE];
+    io_stats own = {0};
+    adapt_state ad = {0};
 
-    bzero(&st, sizeof st);
-    if ((ret = deflateInit2(&st, level?:6, Z_DEFLATED, 31, 9, 0)))
-        ERRgz(end, in);
+    // threaded chunks prime each other, which would spoil resyncing;
+    // --adaptive wants a single stream to retune
+    if (threads > 1 && !rsyncable && !adapt_hi)
+        return write_gz_mt(in, out, fi);
 
-    while ((len = read(in, st.next_in = inbuf, sizeof inbuf)) > 0)
+    if (!(st = deflate_take(level?:6)))
+        ERRoom(end, in);
+    if (adapt_hi)
     {
-        st.avail_in = len;
+        if (!fi->stats)
+            fi->stats = &own;
+        adapt_start(&ad, fi, level?:6, adapt_lo, adapt_hi);
+    }
+    int lev = level?:6;
+
+    while ((len = get_input(in, fi, &data, inbuf, sizeof inbuf)) > 0)
+    {
+        // deflate what's buffered at the old level, then switch
+        if (adapt_hi && adapt_level(&ad, fi) != lev)
+        {
+            lev = ad.lev;
+            do
+            {
+                st->next_out  = outbuf;
+                st->avail_out = sizeof outbuf;
+                ret = deflateParams(st, lev, Z_DEFAULT_STRATEGY);
+                if (ret && ret != Z_BUF_ERROR)
+                    ERRgz(fail, in);
+                if (write_out(out, fi, outbuf, st->next_out - outbuf))
+                    ERRlibc(fail, out);
+                fi->sz += st->next_out - outbuf;
+            } while (ret == Z_BUF_ERROR);
+        }
+        st->next_in = (Bytef*)data;
         fi->sd += len;
-        do
+        while (len)
         {
-            st.next_out  = outbuf;
-            st.avail_out = sizeof outbuf;
-            if ((ret = deflate(&st, Z_NO_FLUSH)))
-                ERRgz(fail, in);
+            // --rsyncable: a full flush at each boundary makes the output
+            // from there on independent of what came before
+            bool hit = 0;
+            st->avail_in = rsyncable? rsync_scan(&hash, st->next_in, len, &hit) : len;
+            len -= st->avail_in;
+            int flush = hit? Z_FULL_FLUSH : Z_NO_FLUSH;
+            do
+            {
+                st->next_out  = outbuf;
+                st->avail_out = sizeof outbuf;
+                if ((ret = deflate(st, flush)))
+                    ERRgz(fail, in);
 
-            if (rewrite(out, outbuf, st.next_out - outbuf))
-                ERRlibc(fail, out);
-            fi->sz += st.next_out - outbuf;
-        } while (st.avail_in);
+                if (write_out(out, fi, outbuf, st->next_out - outbuf))
+                    ERRlibc(fail, out);
+                fi->sz += st->next_out - outbuf;
+            } while (st->avail_in || hit && !st->avail_out);
+        }
     }
     if (len)
         ERRlibc(fail, in);
@@ -346,22 +1931,26 @@ static int write_gz(int in, int out, file_info *restrict fi, magic_t head)
     // Flush the stream
     do
     {
-        st.next_out  = outbuf;
-        st.avail_out = sizeof outbuf;
-        ret = deflate(&st, Z_FINISH);
+        st->next_out  = outbuf;
+        st->avail_out = sizeof outbuf;
+        ret = deflate(st, Z_FINISH);
 
-        if (rewrite(out, outbuf, st.next_out - outbuf))
+        if (write_out(out, fi, outbuf, st->next_out - outbuf))
             ERRlibc(fail, out);
-        fi->sz += st.next_out - outbuf;
+        fi->sz += st->next_out - outbuf;
     } while (!ret);
     if (ret != Z_STREAM_END)
         ERRgz(fail, in);
-    deflateEnd(&st);
+    deflate_give(st);
+    if (fi->stats == &own)
+        fi->stats = 0;
     return 0;
 
 fail:
-    deflateEnd(&st);
+    deflate_give(st);
 end:
+    if (fi->stats == &own)
+        fi->stats = 0;
     return 1;
 }
 # undef ERRgz
@@ -391,163 +1980,694 @@ static const char *xzerr(lzma_ret e)
     }
 }
 
-#define ERRxz(l,f) ERR(l,f, "%s", xzerr(ret))
+#define ERRxz(l,f) ERR(l,f, "%s", xzerr(ret))
+#define XZ_BUF (1*MB)
+
+// Setting up a coder on a stream that had one reuses its memory, and
+// with the threaded ones, its threads.
+static __thread lzma_stream *spare_xz;
+
+static lzma_stream *xz_take(void)
+{
+    lzma_stream *st = spare_xz;
+    spare_xz = 0;
+    if (!st && (st = malloc(sizeof(lzma_stream))))
+        *st = (lzma_stream)LZMA_STREAM_INIT;
+    return st;
+}
+
+static void xz_give(lzma_stream *st)
+{
+    if (!st)
+        return;
+    if (!spare_xz)
+        spare_xz = st;
+    else
+    {
+        lzma_end(st);
+        free(st);
+    }
+}
+
+static int read_xz(int in, int out, file_info *restrict fi, magic_t head)
+{
+    uint8_t *inbuf = buf_take(BUF_IN, XZ_BUF), *outbuf = buf_take(BUF_OUT, XZ_BUF);
+    ssize_t len;
+    const void *data;
+    lzma_stream *st = xz_take();
+    lzma_ret ret = 0;
+    int err = 1;
+
+    if (!inbuf || !outbuf || !st)
+        ERRoom(fail, in);
+
+    uint64_t limit = memlimit?: UINT64_MAX;
+#ifdef HAVE_LZMA_DECODER_MT
+    // Only streams with sizes in block headers (as written by threaded
+    // encoders) get split among threads, the rest is decoded serially.
+    if (threads > 1)
+    {
+        lzma_mt mt =
+        {
+            .flags   = LZMA_CONCATENATED,
+            .threads = threads,
+            // above this, liblzma drops threads rather than fail
+            .memlimit_threading = memlimit?: lzma_physmem() / 4 ?: 1,
+            .memlimit_stop = limit,
+        };
+        if (lzma_stream_decoder_mt(st, &mt))
+            ERRoom(fail, in);
+    }
+    else
+#endif
+    if (lzma_stream_decoder(st, limit, LZMA_CONCATENATED))
+        ERRoom(fail, in);
+
+    if (head)
+    {
+        if ((len = read_in(in, fi, inbuf + MLEN, XZ_BUF - MLEN)) == -1)
+            ERRlibc(fail, in);
+        st->avail_in = len + MLEN;
+        st->next_in = inbuf;
+        U64(inbuf) = head;
+        goto work;
+    }
+
+    while ((len = get_input(in, fi, &data, inbuf, XZ_BUF)) > 0)
+    {
+        st->next_in = data;
+        st->avail_in = len;
+work:
+        fi->sz += st->avail_in;
+        do
+        {
+            st->next_out  = outbuf;
+            st->avail_out = XZ_BUF;
+            if ((ret = lzma_code(st, LZMA_RUN)))
+                ERRxz(fail, in);
+
+            if (write_out(out, fi, outbuf, st->next_out - outbuf))
+                ERRlibc(fail, out);
+            fi->sd += st->next_out - outbuf;
+        } while (st->avail_in);
+    }
+    if (len)
+        ERRlibc(fail, in);
+
+    // Flush the stream
+    do
+    {
+        st->next_out  = outbuf;
+        st->avail_out = XZ_BUF;
+        ret = lzma_code(st, LZMA_FINISH);
+
+        if (write_out(out, fi, outbuf, st->next_out - outbuf))
+            ERRlibc(fail, out);
+        fi->sd += st->next_out - outbuf;
+    } while (!ret);
+    if (ret != LZMA_STREAM_END)
+        ERRxz(fail, in);
+    err = 0;
+fail:
+    xz_give(st);
+    buf_give(BUF_IN, inbuf, XZ_BUF);
+    buf_give(BUF_OUT, outbuf, XZ_BUF);
+    return err;
+}
+
+#ifdef HAVE_LZMA_FILE_INFO
+// -l: liblzma knows to read the index from the end, and seeks where it
+// tells us to.
+static int list_xz(int in, file_info *restrict fi)
+{
+    uint8_t buf[BUFFER_SIZE];
+    lzma_stream st = LZMA_STREAM_INIT;
+    lzma_index *idx = 0;
+    uint64_t pos = 0, size = fi->sz;
+    lzma_ret ret = lzma_file_info_decoder(&st, &idx, memlimit?: UINT64_MAX, size);
+    if (ret)
+        ERRxz(end, in);
+
+    for (;;)
+    {
+        if (!st.avail_in)
+        {
+            size_t len = size - pos < sizeof buf? size - pos : sizeof buf;
+            if (pread_in(in, fi, buf, len, pos))
+                ERRlibc(fail, in);
+            st.next_in = buf;
+            st.avail_in = len;
+            pos += len;
+        }
+        ret = lzma_code(&st, LZMA_RUN);
+        if (ret == LZMA_SEEK_NEEDED)
+        {
+            pos = st.seek_pos;
+            st.avail_in = 0;
+        }
+        else if (ret == LZMA_STREAM_END)
+            break;
+        else if (ret)
+            ERRxz(fail, in);
+    }
+    fi->sd = lzma_index_uncompressed_size(idx);
+    lzma_index_end(idx, 0);
+    lzma_end(&st);
+    return 0;
+
+fail:
+    lzma_end(&st);
+end:
+    return 1;
+}
+#else
+# define list_xz 0
+#endif
+
+static int write_xz(int in, int out, file_info *restrict fi, magic_t head)
+{
+    uint8_t *inbuf = buf_take(BUF_IN, XZ_BUF), *outbuf = buf_take(BUF_OUT, XZ_BUF);
+    ssize_t len;
+    const void *data;
+    lzma_stream *st = xz_take();
+    lzma_ret ret = 0;
+    int err = 1;
+
+    if (!inbuf || !outbuf || !st)
+        ERRoom(fail, in);
+
+    int xzlevel = level?:6;
+    if (xzlevel == 1) // xz level 1 is boring, 0 stands out
+        xzlevel = 0;
+#ifdef HAVE_LZMA_ENCODER_MT
+    // Blocks of the threaded encoder carry their sizes in the headers and
+    // the index, which lets them be decompressed in parallel later too.
+    if (threads > 1 || block_size)
+    {
+        lzma_mt mt =
+        {
+            .threads    = threads,
+            .block_size = block_size, // 0 = 3× the dictionary
+            .preset     = xzlevel,
+            .check      = LZMA_CHECK_CRC64,
+        };
+        if (lzma_stream_encoder_mt(st, &mt))
+            ERRoom(fail, in);
+    }
+    else
+#endif
+    if (lzma_easy_encoder(st, xzlevel, LZMA_CHECK_CRC64))
+        ERRoom(fail, in);
+
+    while ((len = get_input(in, fi, &data, inbuf, XZ_BUF)) > 0)
+    {
+        st->next_in = data;
+        st->avail_in = len;
+        fi->sd += len;
+        do
+        {
+            st->next_out  = outbuf;
+            st->avail_out = XZ_BUF;
+            if ((ret = lzma_code(st, LZMA_RUN)))
+                ERRxz(fail, in);
+
+            if (write_out(out, fi, outbuf, st->next_out - outbuf))
+                ERRlibc(fail, out);
+            fi->sz += st->next_out - outbuf;
+        } while (st->avail_in);
+    }
+    if (len)
+        ERRlibc(fail, in);
+
+    // Flush the stream
+    do
+    {
+        st->next_out  = outbuf;
+        st->avail_out = XZ_BUF;
+        ret = lzma_code(st, LZMA_FINISH);
+
+        if (write_out(out, fi, outbuf, st->next_out - outbuf))
+            ERRlibc(fail, out);
+        fi->sz += st->next_out - outbuf;
+    } while (!ret);
+    if (ret != LZMA_STREAM_END)
+        ERRxz(fail, in);
+    err = 0;
+fail:
+    xz_give(st);
+    buf_give(BUF_IN, inbuf, XZ_BUF);
+    buf_give(BUF_OUT, outbuf, XZ_BUF);
+    return err;
+}
+# undef ERRxz
+#endif
+
+#ifdef HAVE_LIBZSTD
+#define ERRzstd(l,f) ERR(l,f, "%s", ZSTD_getErrorName(r))
+
+// unlike all other compressors, zstd levels go 1..19 (..22 as "extreme")
+static int zstd_level_of(int lev)
+{
+    int zlevel = (lev - 1) * 18 / 8 + 1;
+    assert(zlevel <= 19);
+    return zlevel;
+}
+
+static int zstd_level(void)
+{
+    return zstd_level_of(level?:2);
+}
+
+// -D: parsed once, then shared by all files and threads.  A CDict is
+// fixed to the level it was made for, so there's one per level, made as
+// -b's sweep asks for them.
+static ZSTD_CDict *cdicts[20];
+static ZSTD_DDict *ddict;
+static void *dict_buf;
+static size_t dict_len;
+static pthread_mutex_t dict_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static ZSTD_CDict *get_cdict(int zlevel)
+{
+    pthread_mutex_lock(&dict_mutex);
+    if (!cdicts[zlevel])
+        cdicts[zlevel] = ZSTD_createCDict(dict_buf, dict_len, zlevel);
+    ZSTD_CDict *cdict = cdicts[zlevel];
+    pthread_mutex_unlock(&dict_mutex);
+    return cdict;
+}
+
+int load_dict(const char *path, bool decomp)
+{
+    int err = 1;
+    void *buf = 0;
+    struct stat sb;
+    if (!dl_load(&lib_zstd))
+    {
+        fprintf(stderr, "%s: %s\n", exe, lib_zstd.error);
+        return 1;
+    }
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &sb))
+        goto fail;
+    if (!(buf = malloc(sb.st_size?:1)))
+        goto fail;
+    ssize_t len = reread(fd, buf, sb.st_size);
+    if (len == -1)
+        goto fail;
+    if (!decomp)
+    {
+        dict_buf = buf;
+        dict_len = len;
+        buf = 0; // kept for more levels
+    }
+    if (decomp? !(ddict = ZSTD_createDDict(buf, len)) : !get_cdict(zstd_level()))
+        errno = ENOMEM;
+    else
+        err = 0;
+
+fail:
+    if (err)
+        fprintf(stderr, "%s: %s: %m\n", exe, path);
+    if (fd != -1)
+        close(fd);
+    free(buf);
+    return err;
+}
+
+// Training wants many small samples; like zstd, cut bigger files short.
+#define SAMPLE_MAX (128*KB)
+#define SAMPLES_MAX (256*MB)
+#define DICT_SIZE (110*KB)
 
-static int read_xz(int in, int out, file_info *restrict fi, magic_t head)
+static char *samples;
+static size_t samples_len, samples_size, *sample_sizes;
+static unsigned nsamples, max_samples;
+
+int add_sample(int in, file_info *restrict fi)
 {
-    uint8_t inbuf[1*MB], outbuf[1*MB];
-    lzma_stream st = LZMA_STREAM_INIT;
-    lzma_ret ret = 0;
+    if (samples_len + SAMPLE_MAX > SAMPLES_MAX)
+        return 0; // got plenty
+    if (samples_len + SAMPLE_MAX > samples_size)
+    {
+        size_t size = samples_size? samples_size * 2 : 1*MB;
+        char *s = realloc(samples, size);
+        if (!s)
+            ERRoom(end, in);
+        samples = s;
+        samples_size = size;
+    }
+    if (nsamples == max_samples)
+    {
+        unsigned max = max_samples? max_samples * 2 : 256;
+        size_t *ss = realloc(sample_sizes, max * sizeof(size_t));
+        if (!ss)
+            ERRoom(end, in);
+        sample_sizes = ss;
+        max_samples = max;
+    }
 
-    if (lzma_stream_decoder(&st, UINT64_MAX, LZMA_CONCATENATED))
-        ERRoom(end, in);
+    ssize_t len = reread(in, samples + samples_len, SAMPLE_MAX);
+    if (len == -1)
+        ERRlibc(end, in);
+    if (!len)
+        return 0;
+    samples_len += len;
+    sample_sizes[nsamples++] = len;
+    return 0;
 
-    if (head)
+end:
+    return 1;
+}
+
+int train_dict(const char *path, bool overwrite)
+{
+    int err = 1;
+    char *dict = malloc(DICT_SIZE);
+    if (!dict)
+        goto fail;
+    if (!dl_load(&lib_zstd))
     {
-        if ((st.avail_in = read(in, inbuf + MLEN, sizeof inbuf - MLEN)) == -1)
-            ERRlibc(fail, in);
-        st.avail_in += MLEN;
-        st.next_in = inbuf;
-        U64(inbuf) = head;
-        goto work;
+        fprintf(stderr, "%s: %s\n", exe, lib_zstd.error);
+        goto end;
     }
-
-    while ((st.avail_in = read(in, (uint8_t*)(st.next_in = inbuf), sizeof inbuf)) > 0)
+    size_t r = ZDICT_trainFromBuffer(dict, DICT_SIZE, samples, sample_sizes, nsamples);
+    if (ZDICT_isError(r))
     {
-work:
-        fi->sz += st.avail_in;
-        do
-        {
-            st.next_out  = outbuf;
-            st.avail_out = sizeof outbuf;
-            if ((ret = lzma_code(&st, LZMA_RUN)))
-                ERRxz(fail, in);
-
-            if (rewrite(out, outbuf, st.next_out - outbuf))
-                ERRlibc(fail, out);
-            fi->sd += st.next_out - outbuf;
-        } while (st.avail_in);
+        fprintf(stderr, "%s: %s: %s\n", exe, path, ZDICT_getErrorName(r));
+        goto end;
     }
-    if (st.avail_in)
-        ERRlibc(fail, in);
 
-    // Flush the stream
-    do
+    int fd = open(path, O_CREAT|O_WRONLY|O_CLOEXEC|(overwrite? O_TRUNC : O_EXCL), 0666);
+    if (fd == -1)
+        goto fail;
+    if (rewrite(fd, dict, r))
     {
-        st.next_out  = outbuf;
-        st.avail_out = sizeof outbuf;
-        ret = lzma_code(&st, LZMA_FINISH);
-
-        if (rewrite(out, outbuf, st.next_out - outbuf))
-            ERRlibc(fail, out);
-        fi->sd += st.next_out - outbuf;
-    } while (!ret);
-    if (ret != LZMA_STREAM_END)
-        ERRxz(fail, in);
-    lzma_end(&st);
-    return 0;
+        close(fd);
+        goto fail;
+    }
+    if (close(fd))
+        goto fail;
+    err = 0;
+    goto end;
 
 fail:
-    lzma_end(&st);
+    fprintf(stderr, "%s: %s: %m\n", exe, path);
 end:
+    free(dict);
+    free(samples);
+    free(sample_sizes);
+    return err;
+}
+
+// --seekable: independent frames, then a skippable frame listing the
+// compressed and decompressed size of each, so that --range can find
+// its way without decoding everything before.  The layout is that of
+// zstd's contrib/seekable_format.
+#define SEEK_TABLE_NIBBLE 0xE
+#define SEEKABLE_MAGIC 0x8F92EAB1
+#define SEEK_ENTRY 8
+#define SEEK_FOOTER 9
+#define SEEK_FRAMES_MAX 0x8000000U
+
+static int add_frame(uint8_t **table, size_t *n, unsigned long long zlen, size_t dlen)
+{
+    if (*n >= SEEK_FRAMES_MAX || zlen > UINT32_MAX)
+        return errno = EFBIG, -1;
+    if (!(*n & (*n - 1)))
+    {
+        void *t = realloc(*table, (*n? *n * 2 : 1) * SEEK_ENTRY);
+        if (!t)
+            return -1;
+        *table = t;
+    }
+    put_le32(*table + *n * SEEK_ENTRY, zlen);
+    put_le32(*table + *n * SEEK_ENTRY + 4, dlen);
+    ++*n;
+    return 0;
+}
+
+// Returns 1 and the table if there's one at the end of the file, with
+// fi->sz its size, 0 if not, -1 on errors.
+static int read_seek_table(int in, file_info *restrict fi, off_t size, uint8_t **table,
+    uint32_t *nframes, size_t *entry)
+{
+    uint8_t foot[SEEK_FOOTER], head[8];
+    if (size < sizeof foot + sizeof head)
+        return 0;
+    if (pread_in(in, fi, foot, sizeof foot, size - sizeof foot))
+        ERRlibc(end, in);
+    *nframes = get_le32(foot);
+    *entry = foot[4] & 0x80? SEEK_ENTRY + 4 : SEEK_ENTRY;
+    size_t tlen = *nframes * *entry;
+    if (get_le32(foot + 5) != SEEKABLE_MAGIC || foot[4] & 0x7c || *nframes > SEEK_FRAMES_MAX
+        || tlen + sizeof foot + sizeof head > size)
+        return 0;
+    off_t table_at = size - sizeof foot - tlen;
+    if (pread_in(in, fi, head, sizeof head, table_at - sizeof head))
+        ERRlibc(end, in);
+    if (get_le32(head) != (ZSTD_MAGIC_SKIPPABLE_START | SEEK_TABLE_NIBBLE)
+        || get_le32(head + 4) != tlen + sizeof foot)
+        ERR(end, in, "corrupted seek table");
+    if (!(*table = malloc(tlen?: 1)))
+        ERRoom(end, in);
+    if (pread_in(in, fi, *table, tlen, table_at))
+    {
+        free(*table);
+        *table = 0;
+        ERRlibc(end, in);
+    }
+    fi->sz = sizeof head + tlen + sizeof foot;
     return 1;
+
+end:
+    return -1;
 }
 
-static int write_xz(int in, int out, file_info *restrict fi, magic_t head)
+// --range on a seekable file: find the frames that overlap and decode
+// just those.
+static int read_zstd_range(int in, int out, file_info *restrict fi)
 {
-    uint8_t inbuf[1*MB], outbuf[1*MB];
-    lzma_stream st = LZMA_STREAM_INIT;
-    lzma_ret ret = 0;
+    int err = 1;
+    uint8_t *table = 0, *zbuf = 0, *dbuf = 0;
+    size_t zcap = 0, dcap = 0, entry;
+    uint32_t nframes;
+    ZSTD_DStream *dctx = 0;
+    size_t r;
+    struct stat sb;
 
-    int xzlevel = level?:6;
-    if (xzlevel == 1) // xz level 1 is boring, 0 stands out
-        xzlevel = 0;
-    if (lzma_easy_encoder(&st, xzlevel, LZMA_CHECK_CRC64))
+    if (fstat(in, &sb))
+        ERRlibc(end, in);
+    if (!S_ISREG(sb.st_mode))
+        ERR(end, in, "--range needs a regular file");
+    int found = read_seek_table(in, fi, sb.st_size, &table, &nframes, &entry);
+    if (found < 0)
+        goto end;
+    if (!found)
+        ERR(end, in, "no seek table, compress with --seekable");
+    off_t table_end = sb.st_size - fi->sz;
+
+    if (!(dctx = ZSTD_createDStream()))
         ERRoom(end, in);
+    if (ddict && ZSTD_isError(r = ZSTD_DCtx_refDDict(dctx, ddict)))
+        ERRzstd(end, in);
 
-    while ((st.avail_in = read(in, (uint8_t*)(st.next_in = inbuf), sizeof inbuf)) > 0)
+    unsigned long long zpos = 0, dpos = 0, last = range_off + range_len;
+    if (last < range_off)
+        last = ULLONG_MAX;
+    for (uint32_t i = 0; i < nframes && dpos < last; i++)
     {
-        fi->sd += st.avail_in;
-        do
+        size_t zlen = get_le32(table + i * entry), dlen = get_le32(table + i * entry + 4);
+        if (zpos + zlen > table_end)
+            ERR(end, in, "corrupted seek table");
+        if (dpos + dlen <= range_off)
         {
-            st.next_out  = outbuf;
-            st.avail_out = sizeof outbuf;
-            if ((ret = lzma_code(&st, LZMA_RUN)))
-                ERRxz(fail, in);
+            zpos += zlen;
+            dpos += dlen;
+            continue;
+        }
+        if (zlen > zcap && (free(zbuf), !(zbuf = malloc(zcap = zlen))))
+            ERRoom(end, in);
+        if (dlen > dcap && (free(dbuf), !(dbuf = malloc(dcap = dlen))))
+            ERRoom(end, in);
+        if (pread_in(in, fi, zbuf, zlen, zpos))
+            ERRlibc(end, in);
+        fi->sz += zlen;
+        if (ZSTD_isError(r = ZSTD_decompressDCtx(dctx, dbuf, dlen, zbuf, zlen)))
+            ERRzstd(end, in);
+        if (r != dlen)
+            ERR(end, in, "frame %u has the wrong size", i);
+        size_t from = range_off > dpos? range_off - dpos : 0;
+        size_t to = last - dpos < dlen? last - dpos : dlen;
+        if (write_out(out, fi, dbuf + from, to - from))
+            ERRlibc(end, out);
+        fi->sd += to - from;
+        zpos += zlen;
+        dpos += dlen;
+    }
+    err = 0;
 
-            if (rewrite(out, outbuf, st.next_out - outbuf))
-                ERRlibc(fail, out);
-            fi->sz += st.next_out - outbuf;
-        } while (st.avail_in);
+end:
+    ZSTD_freeDStream(dctx);
+    free(table);
+    free(zbuf);
+    free(dbuf);
+    return err;
+}
+
+// -l: the seek table has it all; else frame headers may say, and blocks
+// are walked to find the next frame.
+static int list_zstd(int in, file_info *restrict fi)
+{
+    uint8_t *table = 0, buf[ZSTD_FRAMEHEADERSIZE_MAX];
+    size_t entry, r;
+    uint32_t nframes;
+    unsigned long long size = fi->sz, pos = 0;
+
+    int found = read_seek_table(in, fi, size, &table, &nframes, &entry);
+    fi->sz = size;
+    if (found < 0)
+        return 1;
+    if (found)
+    {
+        for (uint32_t i = 0; i < nframes; i++)
+            fi->sd += get_le32(table + i * entry + 4);
+        free(table);
+        return 0;
     }
-    if (st.avail_in)
-        ERRlibc(fail, in);
 
-    // Flush the stream
-    do
+    while (pos < size)
     {
-        st.next_out  = outbuf;
-        st.avail_out = sizeof outbuf;
-        ret = lzma_code(&st, LZMA_FINISH);
+        ZSTD_frameHeader zfh;
+        size_t len = size - pos < sizeof buf? size - pos : sizeof buf;
+        if (pread_in(in, fi, buf, len, pos))
+            ERRlibc(end, in);
+        if (ZSTD_isError(r = ZSTD_getFrameHeader(&zfh, buf, len)))
+            ERRzstd(end, in);
+        if (r)
+            ERRueof(end, in);
+        pos += zfh.headerSize;
+        if (zfh.frameType == ZSTD_skippableFrame)
+        {
+            pos += zfh.frameContentSize;
+            continue;
+        }
+        if (zfh.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN)
+            fi->sd = SIZE_UNKNOWN;
+        else if (fi->sd != SIZE_UNKNOWN)
+            fi->sd += zfh.frameContentSize;
 
-        if (rewrite(out, outbuf, st.next_out - outbuf))
-            ERRlibc(fail, out);
-        fi->sz += st.next_out - outbuf;
-    } while (!ret);
-    if (ret != LZMA_STREAM_END)
-        ERRxz(fail, in);
-    lzma_end(&st);
+        uint32_t bh = 0;
+        do
+        {
+            if (pread_in(in, fi, buf, 3, pos))
+                ERRlibc(end, in);
+            bh = buf[0] | buf[1] << 8 | buf[2] << 16;
+            pos += 3 + ((bh >> 1 & 3) == 1? 1 : bh >> 3); // RLE: one byte
+        } while (!(bh & 1));
+        if (zfh.checksumFlag)
+            pos += 4;
+    }
+    if (pos != size)
+        ERRueof(end, in);
     return 0;
 
-fail:
-    lzma_end(&st);
 end:
     return 1;
 }
-# undef ERRxz
-#endif
 
-#ifdef HAVE_LIBZSTD
-#define ERRzstd(l,f) ERR(l,f, "%s", ZSTD_getErrorName(r))
+// A reset context keeps its tables, and with workers, its thread pool.
+static __thread ZSTD_CCtx *spare_cctx;
+static __thread ZSTD_DStream *spare_dctx;
+
+static ZSTD_CCtx *cctx_take(void)
+{
+    ZSTD_CCtx *c = spare_cctx;
+    spare_cctx = 0;
+    if (!c)
+        return ZSTD_createCCtx();
+    ZSTD_CCtx_reset(c, ZSTD_reset_session_and_parameters);
+    return c;
+}
+
+static void cctx_give(ZSTD_CCtx *c)
+{
+    if (spare_cctx)
+        ZSTD_freeCCtx(c);
+    else
+        spare_cctx = c;
+}
+
+static ZSTD_DStream *dctx_take(void)
+{
+    ZSTD_DStream *d = spare_dctx;
+    spare_dctx = 0;
+    if (!d)
+        return ZSTD_createDStream();
+    ZSTD_DCtx_reset(d, ZSTD_reset_session_and_parameters);
+    return d;
+}
+
+static void dctx_give(ZSTD_DStream *d)
+{
+    if (spare_dctx)
+        ZSTD_freeDStream(d);
+    else
+        spare_dctx = d;
+}
 
 static int read_zstd(int in, int out, file_info *restrict fi, magic_t head)
 {
+    if (range_len)
+        return read_zstd_range(in, out, fi);
+
     int err = 1;
     ZSTD_inBuffer  zin;
     ZSTD_outBuffer zout;
     size_t const inbufsz  = ZSTD_DStreamInSize();
+    ssize_t len;
     size_t r;
-    zin.src = malloc(inbufsz);
+    void *inbuf = buf_take(BUF_IN, inbufsz);
     zout.size = ZSTD_DStreamOutSize();
-    zout.dst = malloc(zout.size);
+    zout.dst = buf_take(BUF_OUT, zout.size);
 
-    if (!zin.src || !zout.dst)
+    if (!inbuf || !zout.dst)
         ERRoom(end, in);
 
-    ZSTD_DStream* const stream = ZSTD_createDStream();
+    ZSTD_DStream* const stream = dctx_take();
     if (!stream)
         ERRoom(end, in);
     if (ZSTD_isError(r = ZSTD_initDStream(stream)))
         ERRzstd(fail, in);
+    // Frames say what window they need; allow all that fits in --memlimit
+    // rather than making the user repeat --long.
+    int wlog = ZSTD_WINDOWLOG_MAX;
+    while (memlimit && wlog > ZSTD_WINDOWLOG_MIN && 1ULL << wlog > memlimit)
+        wlog--;
+    if (ZSTD_isError(r = ZSTD_DCtx_setParameter(stream, ZSTD_d_windowLogMax, wlog)))
+        ERRzstd(fail, in);
+    if (ddict && ZSTD_isError(r = ZSTD_DCtx_refDDict(stream, ddict)))
+        ERRzstd(fail, in);
 
     int end_of_frame = 0; // empty file is an error
 
     if (head)
     {
-        if ((r = read(in, (char*)zin.src + MLEN, inbufsz - MLEN)) == -1)
+        if ((len = read_in(in, fi, (char*)inbuf + MLEN, inbufsz - MLEN)) == -1)
             ERRlibc(fail, in);
-        r += MLEN;
-        U64(zin.src) = head;
+        len += MLEN;
+        U64(inbuf) = head;
+        zin.src = inbuf;
         goto work;
     }
 
-    while ((r = read(in, (void*)zin.src, inbufsz)))
+    while ((len = get_input(in, fi, &zin.src, inbuf, inbufsz)))
     {
-        if (r == -1)
+        if (len == -1)
             ERRlibc(fail, in);
 work:
-        fi->sz += r;
-        zin.size = r;
+        fi->sz += len;
+        zin.size = len;
         zin.pos = 0;
         while (zin.pos < zin.size)
         {
@@ -556,7 +2676,7 @@ work:
                 ERRzstd(fail, in);
             end_of_frame = !r;
             fi->sd += zout.pos;
-            if (rewrite(out, zout.dst, zout.pos))
+            if (write_out(out, fi, zout.dst, zout.pos))
                 ERRlibc(fail, out);
         }
     }
@@ -571,7 +2691,7 @@ work:
         if (ZSTD_isError(r = ZSTD_decompressStream(stream, &zout, &zin)))
             ERRzstd(fail, in);
         fi->sd += zout.pos;
-        if (rewrite(out, zout.dst, zout.pos))
+        if (write_out(out, fi, zout.dst, zout.pos))
             ERRlibc(fail, out);
         // write first, fail later -- hopefully salvaging some data
         if (r)
@@ -580,10 +2700,10 @@ work:
 
     err = 0;
 fail:
-    ZSTD_freeDStream(stream);
+    dctx_give(stream);
 end:
-    free((void*)zin.src);
-    free(zout.dst);
+    buf_give(BUF_IN, inbuf, inbufsz);
+    buf_give(BUF_OUT, zout.dst, zout.size);
     return err;
 }
 
@@ -593,58 +2713,174 @@ static int write_zstd(int in, int out, file_info *restrict fi, magic_t head)
     ZSTD_inBuffer  zin;
     ZSTD_outBuffer zout;
     size_t const inbufsz  = ZSTD_CStreamInSize();
+    ssize_t len;
     size_t r;
-    zin.src = malloc(inbufsz);
+    void *inbuf = buf_take(BUF_IN, inbufsz);
     zout.size = ZSTD_CStreamOutSize();
-    zout.dst = malloc(zout.size);
-
-    if (!zin.src || !zout.dst)
+    zout.dst = buf_take(BUF_OUT, zout.size);
+    io_stats own = {0};
+    adapt_state ad = {0};
+    uint8_t *table = 0; // --seekable: sizes of each frame
+    size_t nframes = 0, frame_left = seek_frame;
+    unsigned long long frame_z = 0;
+    bool ended = 0; // a frame was just finished
+
+    if (!inbuf || !zout.dst)
         ERRoom(end, in);
 
-    ZSTD_CStream* const stream = ZSTD_createCStream();
+    ZSTD_CCtx* const stream = cctx_take();
     if (!stream)
         ERRoom(end, in);
-    // unlike all other compressors, zstd levels go 1..19 (..22 as "extreme")
-    int zlevel = ((level?:2) - 1) * 18 / 8 + 1;
-    assert(zlevel <= 19);
-    if (ZSTD_isError(r = ZSTD_initCStream(stream, zlevel)))
+    if (ZSTD_isError(r = ZSTD_CCtx_setParameter(stream, ZSTD_c_compressionLevel, zstd_level())))
         ERRzstd(fail, in);
+    if (dict_buf)
+    {
+        ZSTD_CDict *cdict = get_cdict(zstd_level());
+        if (!cdict)
+            ERRoom(fail, in);
+        if (ZSTD_isError(r = ZSTD_CCtx_refCDict(stream, cdict)))
+            ERRzstd(fail, in);
+    }
     ZSTD_CCtx_setParameter(stream, ZSTD_c_checksumFlag, 1);
+    // Recorded in the frame header, for -l; a seekable file has its table.
+    // Only a mapping can't change size under us, else a file that grows
+    // or shrinks while compressed would fail.
+    if (fi->map && !fi->from && !seek_frame
+        && ZSTD_isError(r = ZSTD_CCtx_setPledgedSrcSize(stream, fi->map_len)))
+        ERRzstd(fail, in);
+    // --long: match against far back; read_zstd() accepts any window
+    if (long_window)
+    {
+        if (ZSTD_isError(r = ZSTD_CCtx_setParameter(stream, ZSTD_c_enableLongDistanceMatching, 1)))
+            ERRzstd(fail, in);
+        if (ZSTD_isError(r = ZSTD_CCtx_setParameter(stream, ZSTD_c_windowLog, long_window)))
+            ERRzstd(fail, in);
+    }
+    // Unless given --block-size, job size and overlap are left to libzstd,
+    // which scales them with the window; the output depends only on the
+    // level and thread count.
+    // A libzstd built without threads refuses this, we then stay serial.
+    // --rsyncable works only in libzstd's threaded mode, even with one worker;
+    // so do level changes mid-frame, which --adaptive makes.
+    if (threads > 1 || rsyncable || adapt_hi)
+    {
+        ZSTD_CCtx_setParameter(stream, ZSTD_c_nbWorkers, threads);
+        if (block_size)
+            ZSTD_CCtx_setParameter(stream, ZSTD_c_jobSize, block_size < GB? block_size : GB);
+        if (rsyncable && ZSTD_isError(r = ZSTD_CCtx_setParameter(stream, ZSTD_c_rsyncable, 1)))
+            ERRzstd(fail, in);
+    }
+    if (adapt_hi)
+    {
+        if (!fi->stats)
+            fi->stats = &own;
+        adapt_start(&ad, fi, zstd_level(), zstd_level_of(adapt_lo), zstd_level_of(adapt_hi));
+    }
+    int lev = zstd_level();
 
-    while ((r = read(in, (void*)zin.src, inbufsz)))
+    while ((len = get_input(in, fi, &zin.src, inbuf, inbufsz)))
     {
-        if (r == -1)
+        if (len == -1)
             ERRlibc(fail, in);
-        fi->sd += r;
-        zin.size = r;
+        if (adapt_hi && adapt_level(&ad, fi) != lev)
+            if (ZSTD_isError(r = ZSTD_CCtx_setParameter(stream, ZSTD_c_compressionLevel, lev = ad.lev)))
+                ERRzstd(fail, in);
+        fi->sd += len;
+        zin.size = len;
         zin.pos = 0;
         while (zin.pos < zin.size)
+        {
+            // --seekable: end the frame once it holds enough
+            size_t full = zin.size, pos = zin.pos;
+            ZSTD_EndDirective mode = ZSTD_e_continue;
+            if (seek_frame && full - pos >= frame_left)
+                zin.size = pos + frame_left, mode = ZSTD_e_end;
+            // a short first read is all there is; ending the frame in the
+            // same call records its size too
+            else if (!seek_frame && fi->sd == len && len < inbufsz)
+                mode = ZSTD_e_end;
+            do
+            {
+                zout.pos = 0;
+                if (ZSTD_isError(r = ZSTD_compressStream2(stream, &zout, &zin, mode)))
+                    ERRzstd(fail, in);
+                if (write_out(out, fi, zout.dst, zout.pos))
+                    ERRlibc(fail, out);
+                fi->sz += zout.pos;
+                frame_z += zout.pos;
+            } while (mode == ZSTD_e_end? r : zin.pos < zin.size);
+            zin.size = full;
+            ended = mode == ZSTD_e_end;
+            if (!seek_frame)
+                continue;
+            frame_left -= zin.pos - pos;
+            if (mode == ZSTD_e_end && add_frame(&table, &nframes, frame_z, seek_frame))
+                ERRlibc(fail, out);
+            if (mode == ZSTD_e_end)
+                frame_left = seek_frame, frame_z = 0;
+        }
+    }
+
+    // with workers, the tail may take more than one call to drain; a
+    // frame that just ended has nothing left
+    zin.size = zin.pos = 0;
+    if (!ended)
+        do
         {
             zout.pos = 0;
-            if (ZSTD_isError(r = ZSTD_compressStream(stream, &zout, &zin)))
+            if (ZSTD_isError(r = ZSTD_compressStream2(stream, &zout, &zin, ZSTD_e_end)))
                 ERRzstd(fail, in);
-            if (rewrite(out, zout.dst, zout.pos))
+            if (write_out(out, fi, zout.dst, zout.pos))
                 ERRlibc(fail, out);
             fi->sz += zout.pos;
-        }
-    }
+            frame_z += zout.pos;
+        } while (r);
 
-    zout.pos = 0;
-    if (ZSTD_isError(r = ZSTD_endStream(stream, &zout)))
-        ERRzstd(fail, in);
-    if (rewrite(out, zout.dst, zout.pos))
-        ERRlibc(fail, out);
-    fi->sz += zout.pos;
+    if (seek_frame)
+    {
+        if (frame_z && add_frame(&table, &nframes, frame_z, seek_frame - frame_left))
+            ERRlibc(fail, out);
+        size_t tlen = nframes * SEEK_ENTRY + SEEK_FOOTER;
+        uint8_t head[8], foot[SEEK_FOOTER] = {0};
+        put_le32(head, ZSTD_MAGIC_SKIPPABLE_START | SEEK_TABLE_NIBBLE);
+        put_le32(head + 4, tlen);
+        put_le32(foot, nframes);
+        put_le32(foot + 5, SEEKABLE_MAGIC); // descriptor: no checksums
+        if (write_out(out, fi, head, sizeof head)
+            || write_out(out, fi, table, nframes * SEEK_ENTRY)
+            || write_out(out, fi, foot, sizeof foot))
+            ERRlibc(fail, out);
+        fi->sz += sizeof head + tlen;
+    }
 
     err = 0;
 fail:
-    ZSTD_freeCStream(stream);
+    cctx_give(stream);
 end:
-    free((void*)zin.src);
-    free(zout.dst);
+    if (fi->stats == &own)
+        fi->stats = 0;
+    free(table);
+    buf_give(BUF_IN, inbuf, inbufsz);
+    buf_give(BUF_OUT, zout.dst, zout.size);
     return err;
 }
 # undef ERRzstd
+#else
+int load_dict(const char *path, bool decomp)
+{
+    fprintf(stderr, "%s: dictionaries need zstd support\n", exe);
+    return 1;
+}
+
+int add_sample(int in, file_info *restrict fi)
+{
+    return 0;
+}
+
+int train_dict(const char *path, bool overwrite)
+{
+    return load_dict(path, 0);
+}
 #endif
 
 static int cat(int in, int out, file_info *restrict fi, magic_t head)
@@ -652,8 +2888,16 @@ static int cat(int in, int out, file_info *restrict fi, magic_t head)
     if (out == -1)
         return 0;
 
+    if (fi->map)
+    {
+        if (write_out(out, fi, fi->map, fi->map_len))
+            ERRlibc(end, out);
+        fi->sz = fi->sd = fi->map_len;
+        return 0;
+    }
+
     // hack: head might be 0 but cat always gets it
-    if (rewrite(out, &head, MLEN))
+    if (write_out(out, fi, &head, MLEN))
         ERRlibc(end, out);
     fi->sz = fi->sd = MLEN;
 
@@ -661,6 +2905,8 @@ static int cat(int in, int out, file_info *restrict fi, magic_t head)
 #ifdef HAVE_COPY_FILE_RANGE
     while ((r = copy_file_range(in, 0, out, 0, PTRDIFF_MAX, 0)) > 0)
     {
+        if (fi->stats)
+            fi->stats->writes++;
         fi->sz += r;
         fi->sd += r;
     }
@@ -673,7 +2919,9 @@ static int cat(int in, int out, file_info *restrict fi, magic_t head)
     char buf[BUFFER_SIZE];
     while ((r = read(in, buf, sizeof buf)) > 0)
     {
-        if (rewrite(out, buf, r))
+        if (fi->stats)
+            fi->stats->reads++;
+        if (write_out(out, fi, buf, r))
             ERRlibc(end, out);
         fi->sz += r;
         fi->sd += r;
@@ -686,46 +2934,187 @@ end:
     return 1;
 }
 
+// For threads that are done with files.
+void pool_free(void)
+{
+    for (int i = 0; i < BUF_SLOTS; i++)
+    {
+        free(bufs[i].p);
+        bufs[i].p = 0;
+    }
+#ifdef HAVE_LIBZ
+    if (spare_deflate)
+        deflateEnd(spare_deflate);
+    if (spare_inflate)
+        inflateEnd(spare_inflate);
+    free(spare_deflate);
+    free(spare_inflate);
+    spare_deflate = spare_inflate = 0;
+#endif
+#ifdef HAVE_LIBLZMA
+    if (spare_xz)
+        lzma_end(spare_xz);
+    free(spare_xz);
+    spare_xz = 0;
+#endif
+#ifdef HAVE_LIBZSTD
+    if (spare_cctx)
+        ZSTD_freeCCtx(spare_cctx);
+    if (spare_dctx)
+        ZSTD_freeDStream(spare_dctx);
+    spare_cctx = 0;
+    spare_dctx = 0;
+#endif
+#ifdef HAVE_LIBBZ3
+    bz3_pool_free();
+#endif
+}
+
+#ifdef HAVE_LIBBZ3
+extern dl_lib lib_bz3;
+#endif
+
 compress_info compressors[]={
 #ifdef HAVE_LIBZSTD
-{"zstd", ".zst",  write_zstd},
+{"zstd", ".zst",  write_zstd, &lib_zstd},
 #endif
 #ifdef HAVE_LIBBZ3
-{"bzip3", ".bz3", write_bz3},
+{"bzip3", ".bz3", write_bz3, &lib_bz3},
 #endif
 #ifdef HAVE_LIBLZMA
-{"xz", ".xz",  write_xz},
+{"xz", ".xz",  write_xz, &lib_lzma},
 #endif
 #ifdef HAVE_LIBZ
-{"gzip", ".gz",  write_gz},
+{"gzip", ".gz",  write_gz, &lib_z},
 #endif
 #ifdef HAVE_LIBBZ2
-{"bzip2", ".bz2", write_bz2},
+{"bzip2", ".bz2", write_bz2, &lib_bz2},
 #endif
 {0, 0, 0},
 };
 
 compress_info decompressors[]={
 #ifdef HAVE_LIBZSTD
-{"zstd", ".zst",  read_zstd, {0x28,0xb5,0x2f,0xfd}, {0xff,0xff,0xff,0xff}},
+{"zstd", ".zst",  read_zstd, &lib_zstd, {0x28,0xb5,0x2f,0xfd}, {0xff,0xff,0xff,0xff}, list_zstd},
 #endif
 #ifdef HAVE_LIBBZ3
-{"bzip3", ".bz3", read_bz3, "BZ3v1", {0xff,0xff,0xff,0xff,0xff}},
+{"bzip3", ".bz3", read_bz3, &lib_bz3, "BZ3v1", {0xff,0xff,0xff,0xff,0xff}, list_bz3},
 #endif
 #ifdef HAVE_LIBLZMA
-{"xz", ".xz",  read_xz, {0xfd,0x37,0x7a,0x58,0x5a}, {0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xf0}},
+{"xz", ".xz",  read_xz, &lib_lzma, {0xfd,0x37,0x7a,0x58,0x5a}, {0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xf0}, list_xz},
 #endif
 #ifdef HAVE_LIBZ
-{"gzip", ".gz",  read_gz, {0x1f,0x8b,8}, {0xff,0xff,0xff,0xe0}},
+{"gzip", ".gz",  read_gz, &lib_z, {0x1f,0x8b,8}, {0xff,0xff,0xff,0xe0}, list_gz},
 #endif
 #ifdef HAVE_LIBBZ2
-{"bzip2", ".bz2", read_bz2, "BZh01AY&", {0xff,0xff,0xff,0xf0,0xff,0xff,0xff,0xff}},
+{"bzip2", ".bz2", read_bz2, &lib_bz2, "BZh01AY&", {0xff,0xff,0xff,0xf0,0xff,0xff,0xff,0xff}},
 // empty file has no BlockHeader
-{"", "/", read_bz2, "BZh0\x17rE8", {0xff,0xff,0xff,0xf0,0xff,0xff,0xff,0xff}},
+{"", "/", read_bz2, &lib_bz2, "BZh0\x17rE8", {0xff,0xff,0xff,0xf0,0xff,0xff,0xff,0xff}},
 #endif
 {0, 0, 0},
 };
 
+static bool verify_magic(magic_t head, const compress_info *comp)
+{
+    return (head & U64(comp->magicmask)) == U64(comp->magic);
+}
+
+// --recompress: the decoder gets a thread of its own and feeds the
+// encoder here through a ring buffer, sparing a pipe and the copying
+// through the kernel.
+#define RING_SIZE (4*MB)
+
+typedef struct
+{
+    worker              w;
+    int                 in;
+    file_info           fi;
+    bool                err;
+} recode_job;
+
+static void run_recode(worker *w)
+{
+    recode_job *job = (recode_job*)w;
+    job->err = decomp(0, job->in, -1, &job->fi);
+    ring_close(job->fi.to); // a failed decoder is reported by itself
+    pool_free(); // the thread goes away after this file
+}
+
+bool recompress(int in, int out, file_info*restrict fi, const compress_info *comp)
+{
+    ring r;
+    bool err = 1;
+    if (!ring_init(&r, RING_SIZE))
+        ERRoom(end, in);
+    recode_job job =
+    {
+        .in = in,
+        .fi =
+        {
+            .path = fi->path, .name_in = fi->name_in, .name_out = fi->name_out,
+            .map = fi->map, .map_len = fi->map_len, .to = &r,
+        },
+    };
+    if (!worker_start(&job.w, run_recode))
+        ERRlibc(fail, in);
+    worker_run(&job.w);
+
+    // the mapping is the decoder's; the encoder's input is the ring
+    const uint8_t *map = fi->map;
+    size_t map_len = fi->map_len;
+    fi->map = 0;
+    fi->map_len = 0;
+    fi->from = &r;
+    err = comp->comp(-1, out, fi, 0);
+    fi->from = 0;
+    fi->map = map;
+    fi->map_len = map_len;
+    if (err)
+        ring_abort(&r); // the decoder will stop at its next write
+    worker_stop(&job.w);
+    err |= job.err;
+
+fail:
+    ring_free(&r);
+end:
+    return err;
+}
+
+// -l: sizes from headers and trailers only; the uncompressed one is
+// SIZE_UNKNOWN where the format doesn't keep it.
+bool list_file(int in, file_info*restrict fi)
+{
+    uint64_t head = 0;
+    struct stat sb;
+    if (fstat(in, &sb))
+        ERRlibc(err, in);
+    if (!S_ISREG(sb.st_mode))
+        ERR(err, in, "-l needs a regular file");
+    fi->sz = sb.st_size;
+    if (sb.st_size < MLEN)
+        ERR(err, in, "not a compressed file");
+    if (pread_in(in, fi, &head, MLEN, 0))
+        ERRlibc(err, in);
+
+    for (const compress_info *ci = decompressors; ci->comp; ci++)
+        if (verify_magic(head, ci))
+            if (!dl_load(ci->lib))
+                ERR(err, in, "%s", ci->lib->error);
+            else
+            {
+                fi->format = *ci->name? ci->name : "bzip2";
+                if (ci->list)
+                    return ci->list(in, fi);
+                fi->sd = SIZE_UNKNOWN;
+                return 0;
+            }
+
+    ERR(err, in, "not a compressed file");
+
+err:
+    return 1;
+}
+
 int match_suffix(const char *txt, const char *ext)
 {
     int tl,el;
@@ -738,6 +3127,12 @@ int match_suffix(const char *txt, const char *ext)
     return !strncmp(txt, ext, el);
 }
 
+// Returns why the codec's library can't be used, if it can't.
+const char *comp_load(const compress_info *ci)
+{
+    return dl_load(ci->lib)? 0 : ci->lib->error;
+}
+
 compress_info *comp_by_ext(const char *name, compress_info *ci)
 {
     for (;ci->name;ci++)
@@ -754,33 +3149,45 @@ compress_info *comp_by_name(const char *name, compress_info *ci)
     return 0;
 }
 
-static bool verify_magic(magic_t head, const compress_info *comp)
-{
-    return (head & U64(comp->magicmask)) == U64(comp->magic);
-}
-
 bool decomp(bool can_cat, int in, int out, file_info*restrict fi)
 {
-    uint64_t head;
-    ssize_t r = read(in, &head, MLEN);
-    if (r == -1)
+    uint64_t head = 0;
+    ssize_t r;
+    if (fi->map)
+        memcpy(&head, fi->map, r = fi->map_len < MLEN? fi->map_len : MLEN);
+    else if ((r = read_in(in, fi, &head, MLEN)) == -1)
         ERRlibc(err, in);
     if (r < MLEN) // shortest legal file is 9 bytes (zstd w/o checksum)
     {
         if (!can_cat)
             ERR(err, in, "not a compressed file");
-        if (rewrite(out, &head, r))
+        if (write_out(out, fi, &head, r))
             ERRlibc(err, out);
         fi->sd = fi->sz = r;
+        fi->format = "none";
         return 0;
     }
 
     for (const compress_info *ci = decompressors; ci->comp; ci++)
         if (verify_magic(head, ci))
-            return ci->comp(in, out, fi, head);
+            if (!dl_load(ci->lib))
+                ERR(err, in, "%s", ci->lib->error);
+            else if (range_len && strcmp(ci->name, "zstd") && strcmp(ci->name, "gzip"))
+                ERR(err, in, "--range works only with zstd and gzip");
+            else if (index_span && strcmp(ci->name, "gzip"))
+                ERR(err, in, "--build-index works only with gzip");
+            else
+            {
+                fi->format = *ci->name? ci->name : "bzip2";
+                return ci->comp(in, out, fi, fi->map? 0 : head) // mapped: from the start
+                || end_output(out, fi);
+            }
 
     if (can_cat)
+    {
+        fi->format = "none";
         return cat(in, out, fi, head);
+    }
 
     ERR(err, in, "not a compressed file");
 
@@ -1,15 +1,37 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 typedef uint64_t magic_t;
 
+// I/O done on behalf of one file, for --stats.
+typedef struct
+{
+    unsigned long long reads, writes, seeks;
+    double read_time, write_time;
+} io_stats;
+
 typedef struct
 {
     const char *path, *name_in, *name_out;
     unsigned long long sz, sd;
+    const uint8_t *map; // whole input, if mapped
+    size_t map_len, map_ahead;
+    off_t in_pos; // how far get_input() got
+    bool holes; // input is sparse
+    off_t hole_start, hole_end;
+    unsigned blksize; // of the output if sparse, else 0
+    unsigned long long out_pos, hole;
+    unsigned zeros; // held back at the start of a block, maybe a hole
+    struct ring *from, *to; // --recompress: instead of the fds
+    io_stats *stats; // if wanted
+    const char *format; // what decomp() found
 } file_info;
 
 typedef int(compress_func)(int,int,file_info*restrict,magic_t);
+typedef int(list_func)(int,file_info*restrict);
+
+#define SIZE_UNKNOWN (~0ULL)
 
 #define MLEN 8
 typedef struct
@@ -17,19 +39,39 @@ typedef struct
     const char          *name;
     const char          *ext;
     compress_func       *comp;
+    struct dl_lib       *lib;
     char		magic[MLEN], magicmask[MLEN];
+    list_func           *list;
 } compress_info;
 
 extern compress_info compressors[];
 extern compress_info decompressors[];
 
+const char *comp_load(const compress_info *ci);
 compress_info *comp_by_ext(const char *name, compress_info *ci);
 compress_info *comp_by_name(const char *name, compress_info *ci);
 
 bool decomp(bool can_cat, int in, int out, file_info*restrict fi);
+bool list_file(int in, file_info*restrict fi);
+bool recompress(int in, int out, file_info*restrict fi, const compress_info *comp);
 
 int match_suffix(const char *txt, const char *ext);
 int rewrite(int fd, const void *buf, size_t len);
+int write_out(int fd, file_info *restrict fi, const void *buf, size_t len);
+ssize_t reread(int fd, void *buf, size_t len);
+double now(void);
+ssize_t get_input(int fd, file_info *restrict fi, const void **data, void *buf, size_t len);
+ssize_t copy_input(int fd, file_info *restrict fi, void *buf, size_t len);
+int pread_in(int fd, file_info *restrict fi, void *buf, size_t len, off_t off);
+void pool_free(void);
+
+int benchmark(const char *path, compress_info *only, int lo, int hi);
+
+int load_dict(const char *path, bool decomp);
+int add_sample(int in, file_info *restrict fi);
+int train_dict(const char *path, bool overwrite);
 
 int read_bz3(int in, int out, file_info *restrict fi, magic_t head);
 int write_bz3(int in, int out, file_info *restrict fi, magic_t head);
+int list_bz3(int in, file_info *restrict fi);
+void bz3_pool_free(void);
@@ -1,7 +1,18 @@
 #cmakedefine HAVE_LIBZ
 #cmakedefine HAVE_LIBBZ2
 #cmakedefine HAVE_LIBLZMA
+#cmakedefine HAVE_LZMA_ENCODER_MT
+#cmakedefine HAVE_LZMA_DECODER_MT
+#cmakedefine HAVE_LZMA_FILE_INFO
 #cmakedefine HAVE_LIBZSTD
 #cmakedefine HAVE_LIBBZ3
 #cmakedefine HAVE_COPY_FILE_RANGE
 #cmakedefine HAVE_STAT64
+#cmakedefine HAVE_MALLOC_TRIM
+#cmakedefine HAVE_IO_URING
+#cmakedefine USE_DLOPEN
+#define SONAME_Z "@SONAME_Z@"
+#define SONAME_BZ2 "@SONAME_BZ2@"
+#define SONAME_LZMA "@SONAME_LZMA@"
+#define SONAME_ZSTD "@SONAME_ZSTD@"
+#define SONAME_BZ3 "@SONAME_BZ3@"
@@ -0,0 +1,39 @@
+#include "config.h"
+#ifdef USE_DLOPEN
+#include <dlfcn.h>
+#include <pthread.h>
+#include <string.h>
+#include "dl.h"
+
+static pthread_mutex_t dl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Files may be decompressed in parallel, any of them can get here first.
+bool dl_load(dl_lib *lib)
+{
+    int state = __atomic_load_n(&lib->state, __ATOMIC_ACQUIRE);
+    if (state)
+        return state > 0;
+
+    pthread_mutex_lock(&dl_mutex);
+    if (!(state = lib->state))
+    {
+        void *h = dlopen(lib->soname, RTLD_NOW|RTLD_LOCAL);
+        state = h? 1 : -1;
+        for (int i = 0; h && lib->names[i]; i++)
+            if (!(*lib->ptrs[i] = dlsym(h, lib->names[i])))
+            {
+                state = -1;
+                break;
+            }
+        if (state < 0)
+        {
+            lib->error = strdup(dlerror()?: "can't load");
+            if (h)
+                dlclose(h);
+        }
+        __atomic_store_n(&lib->state, state, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&dl_mutex);
+    return state > 0;
+}
+#endif
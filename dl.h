@@ -0,0 +1,29 @@
+#include <stdbool.h>
+
+// With USE_DLOPEN, codec libraries are loaded on first use rather than at
+// startup, so a run pays only for the ones it needs.  A codec lists the
+// functions it calls and binds each name to a pointer:
+//     #define FOO_SYMS(X) X(foo_init) X(foo_run)
+//     DL_LIB(lib_foo, SONAME_FOO, FOO_SYMS)
+//     #define foo_init dl_foo_init
+//     ...
+typedef struct dl_lib
+{
+    const char          *soname;
+    const char *const   *names;
+    void **const        *ptrs;
+    int                 state; // 0 = not tried, 1 = loaded, -1 = failed
+    char                *error;
+} dl_lib;
+
+#ifdef USE_DLOPEN
+# define DL_DECL(s) static __typeof__(s) *dl_##s;
+# define DL_NAME(s) #s,
+# define DL_PTR(s) (void**)&dl_##s,
+# define DL_LIB(lib, soname, syms) syms(DL_DECL) \
+    dl_lib lib = {soname, (const char *const[]){syms(DL_NAME) 0}, (void **const[]){syms(DL_PTR) 0}};
+bool dl_load(dl_lib *lib); // sets lib->error on failure
+#else
+# define DL_LIB(lib, soname, syms) dl_lib lib;
+# define dl_load(lib) 1
+#endif
@@ -0,0 +1,102 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+bool ring_init(ring *r, size_t size)
+{
+    if (!(r->buf = malloc(size)))
+        return 0;
+    r->size = size;
+    r->head = r->tail = 0;
+    r->closed = r->aborted = 0;
+    pthread_mutex_init(&r->mutex, 0);
+    pthread_cond_init(&r->cond, 0);
+    return 1;
+}
+
+void ring_free(ring *r)
+{
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+    free(r->buf);
+}
+
+// All of it, or -1 if the reader is gone.
+int ring_write(ring *r, const void *buf, size_t len)
+{
+    pthread_mutex_lock(&r->mutex);
+    while (len)
+    {
+        while (r->head - r->tail == r->size && !r->aborted)
+            pthread_cond_wait(&r->cond, &r->mutex);
+        if (r->aborted)
+        {
+            pthread_mutex_unlock(&r->mutex);
+            errno = EPIPE;
+            return -1;
+        }
+        // up to the free space, or the end of the buffer
+        size_t pos = r->head % r->size, n = r->size - (r->head - r->tail);
+        if (n > r->size - pos)
+            n = r->size - pos;
+        if (n > len)
+            n = len;
+        // only the writer touches this part, so copy outside the lock
+        pthread_mutex_unlock(&r->mutex);
+        memcpy(r->buf + pos, buf, n);
+        buf += n;
+        len -= n;
+        pthread_mutex_lock(&r->mutex);
+        r->head += n;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return 0;
+}
+
+// Like reread(): short only at EOF.
+ssize_t ring_read(ring *r, void *buf, size_t len)
+{
+    size_t total = 0;
+
+    pthread_mutex_lock(&r->mutex);
+    while (len)
+    {
+        while (r->head == r->tail && !r->closed)
+            pthread_cond_wait(&r->cond, &r->mutex);
+        if (r->head == r->tail)
+            break;
+        size_t pos = r->tail % r->size, n = r->head - r->tail;
+        if (n > r->size - pos)
+            n = r->size - pos;
+        if (n > len)
+            n = len;
+        pthread_mutex_unlock(&r->mutex);
+        memcpy(buf, r->buf + pos, n);
+        buf += n;
+        len -= n;
+        total += n;
+        pthread_mutex_lock(&r->mutex);
+        r->tail += n;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return total;
+}
+
+void ring_close(ring *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->closed = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+void ring_abort(ring *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->aborted = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
@@ -0,0 +1,25 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A bounded byte queue between one writer thread and one reader thread.
+// The writer blocks while it's full, the reader while it's empty; once
+// the writer closes it the reader gets what's left, then EOF.  If the
+// reader aborts, further writes fail with EPIPE.
+typedef struct ring
+{
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    uint8_t             *buf;
+    size_t              size;
+    unsigned long long  head, tail; // bytes ever written, read
+    bool                closed, aborted;
+} ring;
+
+bool ring_init(ring *r, size_t size); // sets errno
+void ring_free(ring *r);
+int ring_write(ring *r, const void *buf, size_t len);
+ssize_t ring_read(ring *r, void *buf, size_t len);
+void ring_close(ring *r);
+void ring_abort(ring *r);
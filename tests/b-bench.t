@@ -0,0 +1,5 @@
+seq 10000 >file
+$Z -F$TOOL -b1 file >out
+grep -q "^$TOOL  *-1 " out
+! $Z -F$TOOL -b0 file 2>/dev/null
+! $Z -F$TOOL -b5-3 file 2>/dev/null
@@ -0,0 +1,23 @@
+# Zero blocks become holes, including at the end.
+{ echo head; dd if=/dev/zero bs=1M count=16 status=none; echo tail; } >in
+dd if=/dev/zero bs=1M count=4 status=none >>in
+cp in file
+$Z -F$TOOL file
+$Z -d file$EXT
+cmp -b in file
+[ $(du -k file|cut -f1) -lt 1024 ]
+
+# Data that doesn't compress makes the decoders' output come in pieces
+# that don't line up with blocks; holes mustn't depend on that.  5000
+# bytes of data in each 100000 take two or three 4K blocks.
+i=0
+while [ $i -lt 200 ]; do
+  head -c 5000 /dev/urandom
+  head -c 95000 /dev/zero
+  i=$((i + 1))
+done >in
+cp in file
+$Z -F$TOOL file
+$Z -d file$EXT
+cmp -b in file
+[ $(du -k file|cut -f1) -lt 2000 ]
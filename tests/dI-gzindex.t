@@ -0,0 +1,25 @@
+# A sidecar index lets --range start inflating near the offset.
+seq 300000 >file
+$Z -F$TOOL <file >f$EXT
+if [ $TOOL != gzip ]; then
+	! $Z --build-index f$EXT 2>err
+	grep -q "works only with gzip" err
+	exit 0
+fi
+$Z --build-index=64K f.gz
+[ -s f.gz.gzidx ]
+$Z -dc --range=1000000:70000 f.gz >r
+tail -c +1000001 file|head -c 70000|cmp -b - r
+# members after the first are gzip again
+head -c 100000 file|gzip -1 >m.gz
+tail -c +100001 file|gzip -9 >>m.gz
+$Z --build-index=32K m.gz
+$Z -dc --range=99000:1000000 m.gz >r
+tail -c +99001 file|head -c 1000000|cmp -b - r
+echo >>m.gz
+! $Z -dc --range=0:1 m.gz 2>err
+grep -q "index is stale" err
+# never in place of the whole file
+! $Z -d --range=0:10 f.gz 2>err
+grep -q "needs -c" err
+$Z -dc f.gz|cmp -b file -
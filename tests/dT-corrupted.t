@@ -0,0 +1,10 @@
+dd if=/dev/urandom bs=65536 count=4 status=none|od >file
+$TOOL file
+rm -f file # zstd keeps it
+dd if=/dev/zero of=file$EXT bs=4096 seek=16 count=1 conv=notrunc status=none
+! $Z -dc -T1 file$EXT >1 2>/dev/null
+! $Z -dc -T3 file$EXT >3 2>stderr
+cat stderr
+grep -qi corrupt stderr
+# salvages as much as a serial run
+cmp -b 1 3
@@ -0,0 +1,12 @@
+dd if=/dev/urandom bs=65536 count=16 status=none|od >file
+$Z -F$TOOL -T2 --block-size=1M <file >b$EXT
+$Z -dc -T4 <b$EXT|cmp -b file -
+$Z -dc -T4 -M1G <b$EXT|cmp -b file -
+$TOOL -c <file >u$EXT
+$Z -dc -T3 <u$EXT|cmp -b file -
+cat u$EXT b$EXT >ub$EXT
+cat file file >file2
+$Z -dc -T4 <ub$EXT|cmp -b file2 -
+if [ "$TOOL" = xz ]; then
+	! $Z -dc -T4 --memlimit=1K <b$EXT >/dev/null
+fi
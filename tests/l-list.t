@@ -0,0 +1,22 @@
+# Sizes come from metadata alone.
+seq 200000 >file
+$Z -F$TOOL -k --mmap file
+$Z -l file$EXT >out
+head -1 out|grep -q "compressed *uncompressed *ratio format name"
+if [ $TOOL = bzip2 ]; then
+	grep -q " - *- bzip2 *file.bz2$" out
+else
+	grep -q " 1288895 .*% $TOOL *file$EXT$" out
+fi
+cat file$EXT file$EXT >two$EXT
+$Z -l file$EXT two$EXT >out
+[ $(wc -l <out) = 4 ]
+grep -q "(totals)$" out
+case $TOOL in
+zstd|xz|bzip3) grep -q " 2577790 .*two$EXT$" out;;
+esac
+! $Z -l <file 2>err
+# a small file is read whole, so zstd knows its size without a mapping
+seq 1000 >small
+$Z -F$TOOL -k small
+[ $TOOL = bzip2 ] || $Z -l small$EXT|grep -q " 3893 .*small$EXT$"
@@ -0,0 +1,9 @@
+# A file appended to while being compressed: whatever was read makes it.
+seq 3000000 >file
+size=`wc -c <file`
+{ sleep 0.1; seq 1000 >>file; } &
+$Z -F$TOOL -9 -k file
+wait
+$Z -dc file$EXT >out
+test `wc -c <out` -ge $size
+head -c `wc -c <out` file|cmp -b - out
@@ -0,0 +1,18 @@
+# Holes are not read but must still come out as zeroes.
+{ echo head; dd if=/dev/urandom bs=65536 count=2 status=none; } >data
+truncate -s 64M in
+dd if=data of=in bs=1M seek=20 conv=notrunc status=none
+dd if=data of=in bs=1M seek=63 conv=notrunc status=none
+cp --sparse=always in file
+$Z -F$TOOL file
+$TOOL -dc file$EXT|cmp -b in -
+cp --sparse=always in file
+$Z -F$TOOL -fT3 --mmap file
+$Z -dc file$EXT|cmp -b in -
+# holes longer than the zeroes kept around, in blocks that don't fit
+cp --sparse=always in file
+$Z -F$TOOL -fT2 --block-size=4M --mmap file
+$Z -dc file$EXT|cmp -b in -
+cp --sparse=always in file
+$Z -F$TOOL -fT2 --block-size=4M file
+$Z -dc file$EXT|cmp -b in -
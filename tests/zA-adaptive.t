@@ -0,0 +1,13 @@
+# The level wanders but the output must still decompress.
+seq 500000 >file
+case $TOOL in
+zstd|gzip) ;;
+*)	! $Z -F$TOOL --adaptive <file >/dev/null 2>err
+	grep -q "works only with" err
+	exit 0
+esac
+$Z -F$TOOL --adaptive <file >a$EXT
+$Z -dc <a$EXT|cmp -b file -
+$Z -F$TOOL --adaptive=3:5 <file|$Z -dc|cmp -b file -
+! $Z -F$TOOL --adaptive=5:3 <file >/dev/null 2>err
+grep -q "invalid level range" err
@@ -0,0 +1,11 @@
+dd if=/dev/urandom bs=65536 count=16 status=none|od >file
+$Z -F$TOOL --block-size=1M <file >1$EXT
+$Z -F$TOOL -T3 --block-size=1M <file >3$EXT
+$Z -dc <1$EXT|cmp -b file -
+$TOOL -dc <3$EXT|cmp -b file -
+if [ "$TOOL" = xz ]; then
+	xz -lv 3$EXT|grep -q '^ *Blocks: *[2-9]'
+fi
+! $Z -F$TOOL --block-size=1X <file >/dev/null
+! $Z -F$TOOL --block-size=17179869185G <file >/dev/null 2>err
+grep -q "too big" err
@@ -0,0 +1,25 @@
+if [ $TOOL != zstd ]; then
+	! $Z -F$TOOL -D dict </dev/null >/dev/null
+	exit 0
+fi
+mkdir s
+for i in $(seq 100); do
+	echo "{\"id\": $i, \"name\": \"user$i\", \"email\": \"user$i@example.com\", \"tags\": [\"a\", \"b\"]}" >s/$i.json
+done
+$Z --train=dict -r s
+! $Z --train=dict s/1.json 2>/dev/null
+cp s/7.json file
+$Z -F$TOOL -k file
+$Z -F$TOOL -D dict <file >d$EXT
+[ $(wc -c <d$EXT) -lt $(wc -c <file$EXT) ]
+$TOOL -D dict -dc d$EXT|cmp -b file -
+$Z -D dict -dc d$EXT|cmp -b file -
+! $Z -dc d$EXT >/dev/null 2>&1
+cat s/*.json >big
+$Z -1 -D dict -c big >1$EXT
+$Z -9 -D dict -c big >9$EXT
+[ $(wc -c <9$EXT) -lt $(wc -c <1$EXT) ]
+$Z -D dict -dc 9$EXT|cmp -b big -
+! $Z --adaptive -D dict -c big >/dev/null 2>&1
+$Z -F$TOOL -b1-2 -D dict big >out
+grep -q "^$TOOL  *-2 " out
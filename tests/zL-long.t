@@ -0,0 +1,16 @@
+# Repeats far apart that only a big window can see.
+dd if=/dev/urandom bs=1M count=3 status=none >r
+cat r r r r >file
+if [ $TOOL != zstd ]; then
+	! $Z -F$TOOL --long=24 <file >/dev/null 2>err
+	grep -q "works only with zstd" err
+	exit 0
+fi
+$Z -F$TOOL --long=24 <file >l$EXT
+$Z -dc <l$EXT|cmp -b file -
+$Z -F$TOOL <file >s$EXT
+[ $(wc -c <l$EXT) -lt $(($(wc -c <s$EXT) / 2)) ]
+$TOOL -dc --long=24 <l$EXT|cmp -b file -
+! $Z -dc -M1M <l$EXT >/dev/null 2>err
+grep -q "zst: stdin: " err
+! $Z -F$TOOL --long=9 <file >/dev/null 2>err
@@ -0,0 +1,31 @@
+# Straight from one format to another, replacing the file.
+seq 200000 >file
+for f in gzip:gz bzip2:bz2 xz:xz zstd:zst; do
+	[ ${f%:*} = $TOOL ] && continue
+	$Z -F${f%:*} -c file >old.${f#*:}
+	$Z -F$TOOL --recompress old.${f#*:}
+	[ ! -e old.${f#*:} ]
+	$Z -dc old$EXT|cmp -b file -
+	rm old$EXT
+done
+# a broken input leaves no output behind
+[ $TOOL = gzip ] && f=bzip2:bz2 || f=gzip:gz
+$Z -F${f%:*} -c file|head -c 10000 >bad.${f#*:}
+! $Z -F$TOOL --recompress bad.${f#*:} 2>err
+[ -e bad.${f#*:} ] && [ ! -e bad$EXT ]
+! $Z -F$TOOL --recompress -d bad.${f#*:} 2>err
+# threaded encoders read the ring, not the decoder's mapping
+for f in gzip:gz bzip2:bz2 xz:xz zstd:zst; do
+	[ ${f%:*} = $TOOL ] && continue
+	$Z -F${f%:*} -c file >old.${f#*:}
+	$Z -F$TOOL -T2 --mmap --recompress old.${f#*:}
+	$Z -dc old$EXT|cmp -b file -
+	rm old$EXT
+done
+# likewise for small files read ahead by io_uring
+[ $TOOL = gzip ] && f=zstd:zst || f=gzip:gz
+mkdir d
+seq 1000 >small
+$Z -F${f%:*} -c small >d/small.${f#*:}
+$Z -F$TOOL -T2 -r --io-uring --recompress d
+$Z -dc d/small$EXT|cmp -b small -
@@ -0,0 +1,41 @@
+# Independent frames plus a seek table; --range decodes only some.
+seq 300000 >file
+if [ $TOOL != zstd ]; then
+	! $Z -F$TOOL --seekable <file >/dev/null 2>err
+	grep -q "works only with zstd" err
+	exit 0
+fi
+$Z --seekable=64K <file >s.zst
+$Z -dc <s.zst|cmp -b file -
+zstd -dc <s.zst|cmp -b file -
+$Z -dc --range=100000:70000 s.zst >r
+tail -c +100001 file|head -c 70000|cmp -b - r
+$Z -dc --range=2000000 s.zst >r
+tail -c +2000001 file|cmp -b - r
+$Z -dc --range=9999999:1 s.zst|cmp - /dev/null
+$Z <file >p.zst
+! $Z -dc --range=0:1 p.zst 2>err
+grep -q "no seek table" err
+# a footer that doesn't match its table
+cp s.zst c.zst
+printf '\001' | dd of=c.zst bs=1 seek=$(($(wc -c <c.zst) - 9)) conv=notrunc 2>/dev/null
+rc=0
+$Z -l c.zst >/dev/null 2>err || rc=$?
+[ $rc = 1 ]
+grep -q "corrupted seek table" err
+! $Z -dc --range=0:1 c.zst 2>err
+grep -q "corrupted seek table" err
+# only to stdout, the file stays
+cp s.zst k.zst
+! $Z -d --range=0:10 k.zst 2>err
+grep -q "needs -c" err
+$Z -dc k.zst|cmp -b file -
+$Z -t --range=0:10 k.zst
+# no empty frame after one that ends with the input
+head -c 131072 file >e
+$Z --seekable=64K <e >e.zst
+$Z -dc e.zst|cmp -b e -
+zstd -lv e.zst|grep -q "Zstandard Frames: 2$"
+: >n
+$Z --seekable=64K <n >n.zst
+$Z -dc n.zst|cmp -b n -
@@ -0,0 +1,9 @@
+# Enough data for every thread to get a job.
+dd if=/dev/urandom bs=65536 count=32 status=none|od >file
+$Z -F$TOOL -T4 <file >4$EXT
+$Z -F$TOOL -T4 <file >4b$EXT
+cmp 4$EXT 4b$EXT
+$TOOL -dc <4$EXT|cmp -b file -
+$Z -dc <4$EXT|cmp -b file -
+$Z -F$TOOL -T0 <file >0$EXT
+$Z -dc <0$EXT|cmp -b file -
@@ -0,0 +1,17 @@
+# Codec state carried over from file to file must not leak between them,
+# not even from one that failed halfway.
+for i in 1 2 3 4 5 6; do
+  head -c $((i * 20000)) $F >f$i
+done
+cp f3 bad
+$Z -k -F$TOOL f1 f2 f3 f4 f5 f6 bad
+dd if=/dev/zero of=bad$EXT bs=1024 seek=2 count=1 conv=notrunc status=none
+mkdir orig
+mv f1 f2 f3 f4 f5 f6 orig/
+rm bad
+! $Z -d f1$EXT f2$EXT bad$EXT f3$EXT f4$EXT 2>stderr
+grep -q "bad$EXT" stderr
+$Z -j2 -d f5$EXT f6$EXT
+for i in 1 2 3 4 5 6; do
+  cmp f$i orig/f$i
+done
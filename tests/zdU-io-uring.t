@@ -0,0 +1,34 @@
+# Batched opening and reading must find the same files as the plain walk,
+# small, empty, too big to be read ahead, and in subdirectories alike.
+mkdir -p d/sub
+for i in 0 1 2 3 4 5 6 7 8 9; do
+  for j in 0 1 2 3 4 5 6 7 8 9; do
+    echo "$i$j meow" >d/$i$j
+  done
+done
+: >d/empty
+cat $F $F $F >d/sub/big
+big=`wc -c <d/sub/big`
+touch -d @86400 d/00
+ln -s 00 d/link
+cp -pR d orig
+
+$Z --io-uring -vrF$TOOL d 2>stderr || test $? -eq 2
+test `grep -c '^d/[0-9][0-9]: 8 → ' stderr` -eq 100
+grep -q "^d/sub/big: $big → " stderr
+grep -q "d/link is not a directory or a regular file" stderr
+rm d/link orig/link
+test -f d/empty$EXT
+test `find d -name "00$EXT" ! -newermt @86401|wc -l` -eq 1
+$Z --io-uring -trF$TOOL d
+$Z --io-uring -j3 -dr d
+diff -r orig d
+
+# no read() calls for the small files, they came with the batch
+rm -r d
+cp -pR orig d
+$Z --io-uring -vrF$TOOL --stats=json d 2>stats
+grep -q "define HAVE_IO_URING" "$BIN/config.h" || exit 42
+grep -q "io_uring not allowed" stats && exit 42
+test `grep -c '"file":"d/[0-9][0-9]",.*"reads":0,' stats` -eq 100
+grep -q '"file":"d/sub/big",.*"reads":[1-9]' stats
@@ -0,0 +1,23 @@
+HD="0 1 2 3 4 5 6 7 8 9 A B C D E F"
+mkdir d
+for a in $HD; do
+  for b in $HD; do
+    mkdir d/$a$b
+    for c in $HD; do
+      echo meow >d/$a$b/$c
+    done
+    touch -d @86400 d/$a$b/0
+  done
+done
+echo bark >bark
+
+$Z -j4 -vrF$TOOL d bark 2>stderr
+test `grep -c '^d/[0-9A-F][0-9A-F]/[0-9A-F]: 5 → [0-9]* ([0-9]*%)$' stderr` -eq 4096
+test `wc -l <stderr` -eq 4097
+test `find d -name "*$EXT" ! -newermt @86401|wc -l` -eq 256
+$Z -j0 -dr d
+! grep -lrv '^meow$' d
+test ! -e bark
+! $Z -j3 -d bark$EXT nonexistent 2>stderr
+grep -q "can't read nonexistent" stderr
+test -e bark
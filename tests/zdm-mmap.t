@@ -0,0 +1,20 @@
+# Mapped input must give the same results as read().
+dd if=/dev/urandom bs=65536 count=16 status=none|od >file
+# (but zstd records the size of a mapping, which can't change under it)
+$Z -F$TOOL -k file
+mv file$EXT r$EXT
+$Z -F$TOOL -k --mmap file
+[ $TOOL = zstd ] || cmp r$EXT file$EXT
+$Z -dc file$EXT|cmp -b file -
+$Z -F$TOOL -T3 -kf file
+mv file$EXT r$EXT
+$Z -F$TOOL -T3 -kf --mmap file
+[ $TOOL = zstd ] || cmp r$EXT file$EXT
+$Z -dc file$EXT|cmp -b file -
+$TOOL -dc <file$EXT|cmp -b file -
+cat file$EXT file$EXT >cc$EXT
+$Z -d --mmap cc$EXT
+cat file file|cmp -b cc -
+$Z -dT3 --mmap -c file$EXT|cmp -b file -
+echo abc >short
+$Z -dcf --mmap short|cmp short -
@@ -0,0 +1,11 @@
+dd if=/dev/urandom bs=65536 count=4 status=none|od >a
+{ head -c 500000 a; echo edit; tail -c +500001 a; } >b
+$Z -F$TOOL --rsyncable <a >a$EXT
+$Z -F$TOOL --rsyncable <b >b$EXT
+$TOOL -dc <b$EXT|cmp -b b -
+# past the edit, gzip's output is the same but for the trailer
+if [ $TOOL = gzip ]; then
+	tail -c 50000 a$EXT|head -c 49000 >ta
+	tail -c 50000 b$EXT|head -c 49000 >tb
+	cmp ta tb
+fi
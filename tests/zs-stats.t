@@ -0,0 +1,15 @@
+# One JSON line per file, to stderr or the fd given.
+seq 100000 >file
+cp file file2
+$Z -F$TOOL -k --stats=json file file2 2>stats
+[ $(wc -l <stats) = 2 ]
+grep -q '^{"file":"file","op":"compress","format":"'$TOOL'","in_bytes":588895,' stats
+grep -q '"file":"file2",.*"reads":[1-9].*"writes":[1-9].*"peak_rss_kb":[1-9][0-9]*,"ok":true}$' stats
+$Z -d -c --stats-fd=3 file$EXT 3>stats >/dev/null
+grep -q '"op":"decompress","format":"'$TOOL'","in_bytes":[1-9][0-9]*,"out_bytes":588895,' stats
+! $Z -F$TOOL --stats=xml <file >/dev/null 2>err
+# a job's own thread, unless the codec has more
+$Z -F$TOOL -kf -j2 --stats=json file file2 2>stats
+[ $(grep -c '"cpu_of":"thread"' stats) = 2 ]
+$Z -F$TOOL -kf -j2 -T2 --stats=json file file2 2>stats
+[ $(grep -c '"cpu_of":"process"' stats) = 2 ]
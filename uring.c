@@ -0,0 +1,126 @@
+#include "config.h"
+#ifdef HAVE_IO_URING
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+// No liburing: the three syscalls and the shared rings are all we need.
+static void *map_ring(int fd, size_t len, off_t what)
+{
+    void *p = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, what);
+    return p == MAP_FAILED? 0 : p;
+}
+
+bool uring_init(uring *u, unsigned entries, const uint8_t *ops, int nops)
+{
+    struct io_uring_params p = {0};
+    memset(u, 0, sizeof(uring));
+    if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+        return 0;
+
+    u->entries = p.sq_entries;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    // both rings in one mapping since 5.4
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_len > u->sq_len)
+            u->sq_len = u->cq_len;
+        if ((u->sq_ring = map_ring(u->fd, u->sq_len, IORING_OFF_SQ_RING)))
+            u->cq_ring = u->sq_ring;
+    }
+    else if ((u->sq_ring = map_ring(u->fd, u->sq_len, IORING_OFF_SQ_RING)))
+        u->cq_ring = map_ring(u->fd, u->cq_len, IORING_OFF_CQ_RING);
+    if (!u->cq_ring || !(u->sqes = map_ring(u->fd, u->sqes_len, IORING_OFF_SQES)))
+        goto fail;
+
+    u->sq_head  = (unsigned*)((char*)u->sq_ring + p.sq_off.head);
+    u->sq_tail  = (unsigned*)((char*)u->sq_ring + p.sq_off.tail);
+    u->sq_mask  = (unsigned*)((char*)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((char*)u->sq_ring + p.sq_off.array);
+    u->cq_head  = (unsigned*)((char*)u->cq_ring + p.cq_off.head);
+    u->cq_tail  = (unsigned*)((char*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask  = (unsigned*)((char*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((char*)u->cq_ring + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+
+    // a kernel that has io_uring may still lack the ops we want
+    struct io_uring_probe *pr = calloc(1, sizeof(*pr) + 256 * sizeof(struct io_uring_probe_op));
+    if (!pr || syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, pr, 256))
+    {
+        free(pr);
+        goto fail;
+    }
+    for (int i = 0; i < nops; i++)
+        if (ops[i] > pr->last_op || !(pr->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            free(pr);
+            errno = EOPNOTSUPP;
+            goto fail;
+        }
+    free(pr);
+    return 1;
+
+fail:
+    uring_free(u);
+    return 0;
+}
+
+void uring_free(uring *u)
+{
+    int e = errno;
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_len);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_len);
+    if (u->fd != -1)
+        close(u->fd);
+    memset(u, 0, sizeof(uring));
+    u->fd = -1;
+    errno = e;
+}
+
+struct io_uring_sqe *uring_get(uring *u)
+{
+    if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries)
+        return 0;
+    unsigned i = u->tail++ & *u->sq_mask;
+    u->sq_array[i] = i;
+    u->queued++;
+    return memset(&u->sqes[i], 0, sizeof(struct io_uring_sqe));
+}
+
+bool uring_wait(uring *u, uint64_t *user_data, int *res)
+{
+    // the kernel sees new SQEs only once the tail moves
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    while (1)
+    {
+        unsigned head = *u->cq_head;
+        bool ready = head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        if (ready && !u->queued)
+        {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            *user_data = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+        int n = syscall(__NR_io_uring_enter, u->fd, u->queued, !ready, IORING_ENTER_GETEVENTS, 0, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        u->queued -= n;
+    }
+}
+#endif
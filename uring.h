@@ -0,0 +1,25 @@
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Just enough of io_uring to batch syscalls: one ring, used by one thread.
+// Fill SQEs from uring_get(), then uring_wait() submits whatever's queued
+// and hands back completions one by one, each with its result or -errno.
+typedef struct uring
+{
+    int                 fd;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring, *cq_ring;
+    size_t              sq_len, cq_len, sqes_len;
+    unsigned            entries, tail, queued; // tail as filled, queued unsubmitted
+} uring;
+
+// Fails if the kernel can't do it, or can't do any of the given ops.
+bool uring_init(uring *u, unsigned entries, const uint8_t *ops, int nops);
+void uring_free(uring *u);
+struct io_uring_sqe *uring_get(uring *u); // zeroed; 0 if the ring is full
+bool uring_wait(uring *u, uint64_t *user_data, int *res); // sets errno
@@ -0,0 +1,74 @@
+#include <errno.h>
+#include "worker.h"
+
+static void *worker_loop(void *arg)
+{
+    worker *w = arg;
+
+    pthread_mutex_lock(&w->mutex);
+    while (1)
+    {
+        while (w->state == W_IDLE)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        if (w->state == W_EXIT)
+            break;
+        pthread_mutex_unlock(&w->mutex);
+
+        w->func(w);
+
+        pthread_mutex_lock(&w->mutex);
+        w->state = W_IDLE;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return 0;
+}
+
+bool worker_start(worker *w, void (*func)(worker *w))
+{
+    w->func = func;
+    w->state = W_IDLE;
+    pthread_mutex_init(&w->mutex, 0);
+    pthread_cond_init(&w->cond, 0);
+    if ((errno = pthread_create(&w->thread, 0, worker_loop, w)))
+    {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->mutex);
+        return w->started = 0;
+    }
+    return w->started = 1;
+}
+
+void worker_run(worker *w)
+{
+    pthread_mutex_lock(&w->mutex);
+    w->state = W_BUSY;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+void worker_wait(worker *w)
+{
+    if (!w->started)
+        return;
+    pthread_mutex_lock(&w->mutex);
+    while (w->state == W_BUSY)
+        pthread_cond_wait(&w->cond, &w->mutex);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+// Lets a job in progress finish, then reaps the thread.
+void worker_stop(worker *w)
+{
+    if (!w->started)
+        return;
+    worker_wait(w);
+    pthread_mutex_lock(&w->mutex);
+    w->state = W_EXIT;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, 0);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    w->started = 0;
+}
@@ -0,0 +1,20 @@
+#include <pthread.h>
+#include <stdbool.h>
+
+// A thread that runs one job at a time on behalf of the main loop.
+// Embed it as the first member of a job struct; the main thread fills
+// in the job, calls worker_run(), and collects it after worker_wait().
+typedef struct worker
+{
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    void                (*func)(struct worker *w);
+    enum { W_IDLE, W_BUSY, W_EXIT } state;
+    bool                started;
+} worker;
+
+bool worker_start(worker *w, void (*func)(worker *w)); // sets errno
+void worker_run(worker *w);
+void worker_wait(worker *w);
+void worker_stop(worker *w);
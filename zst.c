@@ -1,17 +1,27 @@
 #define _GNU_SOURCE
+#include "config.h"
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 #include "compress.h"
 #include "zst.h"
+#ifdef HAVE_IO_URING
+# include "uring.h"
+#endif
 
 #ifndef HAVE_STAT64
 # define stat64 stat
@@ -23,7 +33,9 @@
 
 #define die(...) do {fprintf(stderr, __VA_ARGS__); exit(1);} while(0)
 #define ARRAYSZ(x) (sizeof(x) / sizeof((x)[0]))
-#define warn(msg, ...) do {if (!quiet) {fprintf(stderr, "%s: " msg, exe, __VA_ARGS__); if (!err) err=2;}} while(0)
+#define SEEK_FRAME (1*MB) // default for --seekable
+#define INDEX_SPAN (1*MB) // and for --build-index
+#define warn(msg, ...) do {if (!quiet) {fprintf(stderr, "%s: " msg, exe, __VA_ARGS__); set_err(2);}} while(0)
 
 const char *exe;
 
@@ -33,10 +45,36 @@ static bool keep;
 static bool quiet;
 static bool verbose;
 static bool recurse;
+static bool use_mmap;
+static bool recomp;
+static bool use_uring;
+static const char *dict, *train;
+static int bench_lo, bench_hi;
+static int stats_fd = -1;
 int level;
+int threads = 1;
+unsigned long long block_size;
+unsigned long long memlimit;
+bool rsyncable;
+int long_window;
+int adapt_lo, adapt_hi;
+unsigned long long seek_frame;
+unsigned long long range_off, range_len;
+unsigned long long index_span;
+static int jobs = 1;
 static int op;
 static int err;
 
+// 1 = error, 2 = warning; an error wins.  Files may be done in parallel.
+static void set_err(int e)
+{
+    int none = 0;
+    if (e == 1)
+        __atomic_store_n(&err, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_compare_exchange_n(&err, &none, e, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
 static compress_info *comp;
 
 static int flink(int dir, int fd, const char *newname)
@@ -51,15 +89,125 @@ static int flink(int dir, int fd, const char *newname)
     return ret;
 }
 
-#define FAIL(msg, ...) do {fprintf(stderr, "%s: " msg, exe, __VA_ARGS__); err=1; goto closure;} while(0)
-static void do_file(int dir, const char *name, const char *path, int fd, struct stat64 *restrict st)
+// With -j, the job's own thread has it all only when the codec doesn't
+// spread to more; otherwise the whole process is taken, other jobs too.
+static bool cpu_own(void)
+{
+    return jobs > 1 && threads == 1 && !recomp;
+}
+
+static double cpu_now(void)
+{
+    struct timespec ts;
+    clock_gettime(cpu_own()? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void json_str(FILE *f, const char *s)
+{
+    putc('"', f);
+    for (; *s; s++)
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < ' ')
+            fprintf(f, "\\u%04x", *s);
+        else
+            putc(*s, f);
+    putc('"', f);
+}
+
+// One line of JSON per file, written whole so that jobs don't interleave.
+static void put_stats(const char *path, const char *name, file_info *restrict fi,
+    bool ok, double wall, double cpu)
+{
+    char *buf;
+    size_t len;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f)
+        return;
+
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru))
+        ru.ru_maxrss = 0;
+    io_stats *io = fi->stats;
+    double codec = wall - io->read_time - io->write_time;
+    char *file;
+    if (asprintf(&file, "%s%s", path, name) == -1)
+        file = 0;
+    fprintf(f, "{\"file\":");
+    json_str(f, file?: name);
+    free(file);
+    fprintf(f, ",\"op\":\"%s\",\"format\":\"%s\",\"in_bytes\":%llu,\"out_bytes\":%llu,"
+        "\"wall_s\":%.6f,\"cpu_s\":%.6f,\"cpu_of\":\"%s\",\"read_s\":%.6f,\"write_s\":%.6f,\"codec_s\":%.6f,"
+        "\"reads\":%llu,\"writes\":%llu,\"seeks\":%llu,\"peak_rss_kb\":%ld,\"ok\":%s}\n",
+        recomp? "recompress" : !op? "compress" : op == 't'? "test" : "decompress",
+        fi->format?: "unknown",
+        op? fi->sz : fi->sd, op? fi->sd : fi->sz,
+        wall, cpu, cpu_own()? "thread" : "process", io->read_time, io->write_time, codec > 0? codec : 0,
+        io->reads, io->writes, io->seeks, ru.ru_maxrss, ok? "true" : "false");
+    if (!fclose(f))
+        if (rewrite(stats_fd, buf, len))
+            {} // nowhere to complain to
+    free(buf);
+}
+
+static struct
+{
+    unsigned files;
+    unsigned long long sz, sd;
+    bool unknown;
+} listed;
+
+static void put_size(unsigned long long sz, unsigned long long sd)
+{
+    if (sd == SIZE_UNKNOWN)
+        printf("%15llu %15s %6s", sz, "-", "-");
+    else
+        printf("%15llu %15llu %5.1f%%", sz, sd, sd? 100.0 - 100.0 * sz / sd : 0.0);
+}
+
+// -l: like gzip's, the ratio is the space saved
+static void put_list(const char *path, const char *name, file_info *restrict fi)
+{
+    if (!listed.files++)
+        printf("%15s %15s %6s %-6s %s\n", "compressed", "uncompressed", "ratio", "format", "name");
+    put_size(fi->sz, fi->sd);
+    printf(" %-6s %s%s\n", fi->format, path, name);
+    listed.sz += fi->sz;
+    listed.sd += fi->sd;
+    listed.unknown |= fi->sd == SIZE_UNKNOWN;
+}
+
+#define FAIL(msg, ...) do {fprintf(stderr, "%s: " msg, exe, __VA_ARGS__); set_err(1); goto closure;} while(0)
+// data, if given, is the whole file already read; the caller frees it.
+static void do_file(int dir, const char *name, const char *path, int fd, struct stat64 *restrict st,
+    const uint8_t *data)
 {
     int out = -1;
     bool notmp = 0;
     char *name2 = 0;
-    compress_info *fcomp = comp;
+    compress_info *fcomp = comp, *from = 0;
+    io_stats io = {0};
+    bool ok = 0;
+    double wall = -1, cpu = 0;
+    file_info fi =
+    {
+        .path     = path,
+        .name_in  = name,
+        .stats    = stats_fd != -1? &io : 0,
+        .format   = op? 0 : comp->name,
+    };
 
-    if (!op && fd>0 && comp_by_ext(name, compressors) && !force)
+    if (train)
+    {
+        if (add_sample(fd, &fi))
+            set_err(1);
+        if (fd > 2)
+            close(fd);
+        return;
+    }
+
+    if (!op && !recomp && fd>0 && comp_by_ext(name, compressors) && !force)
     {
         warn("%s: already has a compression suffix -- unchanged\n", name);
         close(fd);
@@ -72,6 +220,28 @@ static void do_file(int dir, const char *name, const char *path, int fd, struct
         close(fd);
         return;
     }
+    if (recomp && fd>0 && !(from = comp_by_ext(name, decompressors)))
+    {
+        warn("%s: unknown suffix -- ignored\n", name);
+        close(fd);
+        return;
+    }
+    // the new file would take the old one's name while reading it
+    if (from && !strcmp(from->ext, comp->ext))
+    {
+        warn("%s: already %s -- unchanged\n", name, comp->name);
+        close(fd);
+        return;
+    }
+
+    if (op == 'l')
+    {
+        if (list_file(fd, &fi))
+            set_err(1);
+        else
+            put_list(path, name, &fi);
+        goto closure;
+    }
 
     if (op == 't')
         out = -1;
@@ -85,6 +255,8 @@ static void do_file(int dir, const char *name, const char *path, int fd, struct
     {
         if (op)
             name2 = strndup(name, strlen(name) - strlen(fcomp->ext));
+        else if (from)
+            asprintf(&name2, "%.*s%s", (int)(strlen(name) - strlen(from->ext)), name, comp->ext);
         else
             asprintf(&name2, "%s%s", name, comp->ext);
         if (!force)
@@ -106,15 +278,42 @@ static void do_file(int dir, const char *name, const char *path, int fd, struct
         }
     }
 
-    file_info fi;
-    fi.path = path;
-    fi.name_in = name;
     fi.name_out = name2;
-    fi.sz = fi.sd = 0;
+    // a file we've just created can have holes left in it
+    if (op && out > 2)
+    {
+        struct stat64 sb;
+        if (!fstat64(out, &sb) && S_ISREG(sb.st_mode))
+            fi.blksize = sb.st_blksize;
+    }
+    // fewer blocks than its size => has holes worth skipping
+    if (!op && !recomp && st && st->st_blocks < st->st_size / 512)
+        fi.holes = 1;
+    // anything that can't be mapped is read() instead
+    if (data)
+    {
+        fi.map = data;
+        fi.map_len = st->st_size;
+    }
+    else if (use_mmap && st && st->st_size > 0 && st->st_size <= SIZE_MAX)
+    {
+        void *map = mmap(0, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st->st_size, MADV_SEQUENTIAL);
+            fi.map = map;
+            fi.map_len = st->st_size;
+        }
+    }
 
-    if (op? decomp(cat && force, fd, out, &fi) : fcomp->comp(fd, out, &fi, 0))
+    double t0 = now(), c0 = cpu_now();
+    bool failed = op? decomp(cat && force, fd, out, &fi)
+        : recomp? recompress(fd, out, &fi, comp) : fcomp->comp(fd, out, &fi, 0);
+    wall = now() - t0;
+    cpu = cpu_now() - c0;
+    if (failed)
     {
-        err = 1;
+        set_err(1);
         goto closure;
     }
 
@@ -164,8 +363,13 @@ flink_ok:
             fprintf(stderr, "%s%s: 0 %s %llu (header)\n", path, name,
                 op? "←" : "→", fi.sz);
     }
+    ok = 1;
 
 closure:
+    if (fi.stats && wall >= 0) // got as far as the codec
+        put_stats(path, name, &fi, ok, wall, cpu);
+    if (fi.map && fi.map != data)
+        munmap((void*)fi.map, fi.map_len);
     if (notmp)
         if (unlinkat(dir, name2, 0))
             fprintf(stderr, "%s: can't remove temporary file %s%s: %m\n", exe, path, name2);
@@ -177,10 +381,296 @@ closure:
         free(name2);
 }
 
+// A directory being walked; files queued for -j keep it open.
+typedef struct dir_ref
+{
+    int         fd;
+    DIR         *d;
+    char        *path;
+    int         refs;
+} dir_ref;
+
+static dir_ref cwd = {AT_FDCWD, 0, "", 1};
+
+static void dir_put(dir_ref *dr)
+{
+    if (__atomic_sub_fetch(&dr->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    closedir(dr->d);
+    free(dr->path);
+    free(dr);
+}
+
+typedef struct task
+{
+    struct task         *next;
+    dir_ref             *dir;
+    char                *name;
+    int                 fd;
+    struct stat64       st;
+    uint8_t             *data;
+} task;
+
+// A queue of files for -j workers.  It's bounded, as every task holds
+// an open fd.  Messages are whole-line fprintf()s, which stdio already
+// keeps from interleaving.
+static struct
+{
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    task                *head, **tail;
+    int                 len;
+    bool                done;
+    pthread_t           *threads;
+    int                 nthreads;
+} queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void *file_worker(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&queue.mutex);
+        while (!queue.head && !queue.done)
+            pthread_cond_wait(&queue.cond, &queue.mutex);
+        task *t = queue.head;
+        if (t && !(queue.head = t->next))
+            queue.tail = &queue.head;
+        queue.len -= !!t;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.mutex);
+        if (!t)
+        {
+            pool_free();
+            return 0;
+        }
+
+        do_file(t->dir->fd, t->name, t->dir->path, t->fd, &t->st, t->data);
+        dir_put(t->dir);
+        free(t->data);
+        free(t->name);
+        free(t);
+    }
+}
+
+static void start_jobs(void)
+{
+    queue.tail = &queue.head;
+    if (!(queue.threads = malloc(jobs * sizeof(pthread_t))))
+        die("%s: out of memory\n", exe);
+    for (; queue.nthreads < jobs; queue.nthreads++)
+        if ((errno = pthread_create(&queue.threads[queue.nthreads], 0, file_worker, 0)))
+        {
+            if (!queue.nthreads)
+                die("%s: can't create threads: %m\n", exe);
+            break;
+        }
+}
+
+static void finish_jobs(void)
+{
+    pthread_mutex_lock(&queue.mutex);
+    queue.done = 1;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.mutex);
+    for (int i = 0; i < queue.nthreads; i++)
+        pthread_join(queue.threads[i], 0);
+    free(queue.threads);
+}
+
+// Takes ownership of data.
+static void run_file(dir_ref *dr, const char *name, int fd, struct stat64 *restrict st,
+    uint8_t *data)
+{
+    if (!queue.nthreads)
+    {
+        do_file(dr->fd, name, dr->path, fd, st, data);
+        free(data);
+        return;
+    }
+
+    task *t = malloc(sizeof(task));
+    if (!t || !(t->name = strdup(name)))
+    {
+        free(t);
+        fprintf(stderr, "%s: %s%s: Out of memory.\n", exe, dr->path, name);
+        set_err(1);
+        close(fd);
+        free(data);
+        return;
+    }
+    __atomic_add_fetch(&dr->refs, 1, __ATOMIC_RELAXED);
+    t->next = 0;
+    t->dir = dr;
+    t->fd = fd;
+    t->st = *st;
+    t->data = data;
+
+    pthread_mutex_lock(&queue.mutex);
+    while (queue.len >= queue.nthreads * 4)
+        pthread_cond_wait(&queue.cond, &queue.mutex);
+    *queue.tail = t;
+    queue.tail = &t->next;
+    queue.len++;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+#ifdef HAVE_IO_URING
+// -r over many small files: their openat, statx and read are batched
+// through io_uring instead of costing three syscalls each.  The main
+// thread does this while -j workers compress what came before.
+#define BATCH 64
+#define PREFETCH_MAX (64*KB) // bigger ones are read as they're compressed
+
+static uring ur;
+static bool have_uring;
+static struct
+{
+    char                name[NAME_MAX + 1];
+    int                 fd, stat; // or -errno
+    struct statx        stx;
+    uint8_t             *data;
+} batch[BATCH];
+static int nbatch;
+
+static void do_dir(dir_ref *parent, const char *name);
+
+static void stat_from_statx(struct stat64 *restrict st, const struct statx *restrict x)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    st->st_ino = x->stx_ino;
+    st->st_mode = x->stx_mode;
+    st->st_nlink = x->stx_nlink;
+    st->st_uid = x->stx_uid;
+    st->st_gid = x->stx_gid;
+    st->st_size = x->stx_size;
+    st->st_blksize = x->stx_blksize;
+    st->st_blocks = x->stx_blocks;
+    st->st_atim = (struct timespec){x->stx_atime.tv_sec, x->stx_atime.tv_nsec};
+    st->st_mtim = (struct timespec){x->stx_mtime.tv_sec, x->stx_mtime.tv_nsec};
+    st->st_ctim = (struct timespec){x->stx_ctime.tv_sec, x->stx_ctime.tv_nsec};
+}
+
+static void reap(int n, bool reading)
+{
+    uint64_t j;
+    int res;
+    while (n--)
+    {
+        if (!uring_wait(&ur, &j, &res))
+            die("%s: io_uring: %m\n", exe);
+        if (reading)
+        {
+            // a short read leaves it to be done the usual way
+            if (res != (int)batch[j].stx.stx_size)
+            {
+                free(batch[j].data);
+                batch[j].data = 0;
+            }
+        }
+        else if (j & 1)
+            batch[j / 2].stat = res;
+        else
+            batch[j / 2].fd = res;
+    }
+}
+
+static void flush_batch(dir_ref *dr)
+{
+    int n = nbatch, reads = 0, nlater = 0;
+    char *later[BATCH];
+    nbatch = 0;
+
+    for (int j = 0; j < n; j++)
+    {
+        struct io_uring_sqe *sqe = uring_get(&ur);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dr->fd;
+        sqe->addr = (uintptr_t)batch[j].name;
+        sqe->open_flags = O_RDONLY|O_NONBLOCK|O_CLOEXEC|O_LARGEFILE;
+        sqe->user_data = j * 2;
+        // by name, so it follows symlinks just like fstat() on the fd
+        sqe = uring_get(&ur);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dr->fd;
+        sqe->addr = (uintptr_t)batch[j].name;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t)&batch[j].stx;
+        sqe->user_data = j * 2 + 1;
+        batch[j].data = 0;
+    }
+    reap(2 * n, 0);
+
+    // listing and training don't look at the contents
+    for (int j = 0; j < n && op != 'l' && !train; j++)
+    {
+        size_t len = batch[j].stx.stx_size;
+        if (batch[j].fd < 0 || batch[j].stat < 0 || !S_ISREG(batch[j].stx.stx_mode)
+            || !len || len > PREFETCH_MAX || !(batch[j].data = malloc(len)))
+        {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_get(&ur);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = batch[j].fd;
+        sqe->addr = (uintptr_t)batch[j].data;
+        sqe->len = len;
+        sqe->off = 0; // leaves the file position alone
+        sqe->user_data = j;
+        reads++;
+    }
+    reap(reads, 1);
+
+    for (int j = 0; j < n; j++)
+    {
+        struct stat64 st;
+        if (batch[j].fd < 0)
+        {
+            errno = -batch[j].fd;
+            fprintf(stderr, "%s: can't read %s%s: %m\n", exe, dr->path, batch[j].name);
+            set_err(1);
+            continue;
+        }
+        if (batch[j].stat < 0)
+        {
+            errno = -batch[j].stat;
+            fprintf(stderr, "%s: can't stat %s%s: %m\n", exe, dr->path, batch[j].name);
+            set_err(1);
+            close(batch[j].fd);
+            continue;
+        }
+        // replaced by something else since readdir(); recursing would
+        // refill batch[], so only once done with it
+        if (!S_ISREG(batch[j].stx.stx_mode))
+        {
+            close(batch[j].fd);
+            if ((later[nlater] = strdup(batch[j].name)))
+                nlater++;
+            else
+            {
+                fprintf(stderr, "%s: out of memory in %s\n", exe, dr->path);
+                set_err(1);
+            }
+            continue;
+        }
+        stat_from_statx(&st, &batch[j].stx);
+        run_file(dr, batch[j].name, batch[j].fd, &st, batch[j].data);
+    }
+    for (int j = 0; j < nlater; j++)
+    {
+        do_dir(dr, later[j]);
+        free(later[j]);
+    }
+}
+#endif
+
 // may be actually a file
-static void do_dir(int dir, const char *name, const char *path)
+static void do_dir(dir_ref *parent, const char *name)
 {
-    int dirfd = openat(dir, name, O_RDONLY|O_NONBLOCK|O_CLOEXEC|O_LARGEFILE);
+    const char *path = parent->path;
+    dir_ref *dr = 0;
+    int dirfd = openat(parent->fd, name, O_RDONLY|O_NONBLOCK|O_CLOEXEC|O_LARGEFILE);
     if (dirfd == -1)
         FAIL("can't read %s%s: %m\n", path, name);
 
@@ -189,7 +679,7 @@ static void do_dir(int dir, const char *name, const char *path)
         FAIL("can't stat %s%s: %m\n", path, name);
 
     if (S_ISREG(sb.st_mode))
-        return do_file(dir, name, path, dirfd, &sb);
+        return run_file(parent, name, dirfd, &sb, 0);
     if (!recurse)
     {
         warn("%s%s is not a regular file -- ignored\n", path, name);
@@ -203,17 +693,20 @@ static void do_dir(int dir, const char *name, const char *path)
         return;
     }
 
-    char *newpath = alloca(strlen(path) + strlen(name) + 2);
-    if (!newpath)
-        FAIL("out of stack in %s\n", path);
-    sprintf(newpath, "%s%s/", path, name);
+    if (!(dr = malloc(sizeof(dir_ref))) || asprintf(&dr->path, "%s%s/", path, name) == -1)
+    {
+        free(dr);
+        dr = 0;
+        FAIL("out of memory in %s\n", path);
+    }
 
-    DIR *d = fdopendir(dirfd);
-    if (!d)
+    if (!(dr->d = fdopendir(dirfd)))
         FAIL("can't list %s%s: %m\n", path, name);
+    dr->fd = dirfd;
+    dr->refs = 1;
 
     struct dirent *de;
-    while ((de = readdir(d)))
+    while ((de = readdir(dr->d)))
     {
         // "." or ".."
         if (de->d_name[0]=='.' && (!de->d_name[1] || de->d_name[1]=='.' && !de->d_name[2]))
@@ -221,20 +714,104 @@ static void do_dir(int dir, const char *name, const char *path)
 
         if (de->d_type!=DT_DIR && de->d_type!=DT_REG && de->d_type!=DT_UNKNOWN)
         {
-            warn("%s%s is not a directory or a regular file -- ignored\n", path, de->d_name);
+            warn("%s%s is not a directory or a regular file -- ignored\n", dr->path, de->d_name);
             continue;
         }
 
-        do_dir(dirfd, de->d_name, newpath);
+#ifdef HAVE_IO_URING
+        if (have_uring && de->d_type == DT_REG)
+        {
+            strcpy(batch[nbatch].name, de->d_name);
+            if (++nbatch == BATCH)
+                flush_batch(dr);
+            continue;
+        }
+        // keep the order files are done in
+        if (nbatch)
+            flush_batch(dr);
+#endif
+        do_dir(dr, de->d_name);
     }
+#ifdef HAVE_IO_URING
+    if (nbatch)
+        flush_batch(dr);
+#endif
 
-    closedir(d);
+    dir_put(dr);
     return;
 
 closure:
+    if (dr)
+    {
+        free(dr->path);
+        free(dr);
+    }
     close(dirfd);
 }
 
+// long options without a short form
+enum
+{
+    OPT_BLOCK_SIZE = 256,
+    OPT_MMAP,
+    OPT_RSYNCABLE,
+    OPT_LONG,
+    OPT_TRAIN,
+    OPT_STATS,
+    OPT_STATS_FD,
+    OPT_ADAPTIVE,
+    OPT_SEEKABLE,
+    OPT_RANGE,
+    OPT_BUILD_INDEX,
+    OPT_RECOMPRESS,
+    OPT_IO_URING,
+};
+
+// 0 = as many as we have cores
+static int parse_threads(const char *arg, const char *what)
+{
+    char *end;
+    long t = strtol(arg, &end, 10);
+    if (end == arg || *end || t < 0 || t > 4096)
+        die("%s: invalid %s '%s'\n", exe, what, arg);
+    if (!t)
+        t = sysconf(_SC_NPROCESSORS_ONLN);
+    return t > 1? t : 1;
+}
+
+// 64K, 16M, ...
+static unsigned long long parse_size(const char *arg, const char *what)
+{
+    char *end;
+    errno = 0;
+    unsigned long long s = strtoull(arg, &end, 10);
+    if (end == arg || *arg == '-' || errno)
+        die("%s: invalid %s '%s'\n", exe, what, arg);
+    unsigned long long mult = 1;
+    switch (*end)
+    {
+    case 'k': case 'K':
+        mult = KB, end++;
+        break;
+    case 'm': case 'M':
+        mult = MB, end++;
+        break;
+    case 'g': case 'G':
+        mult = GB, end++;
+        break;
+    }
+    if (s > ULLONG_MAX / mult)
+        die("%s: %s '%s' is too big\n", exe, what, arg);
+    s *= mult;
+    if (*end == 'i' && end[1] == 'B')
+        end += 2;
+    else if (*end == 'B')
+        end++;
+    if (*end)
+        die("%s: invalid %s '%s'\n", exe, what, arg);
+    return s;
+}
+
 static const char* guess_prog(void)
 {
     const char *progs[][3] =
@@ -279,14 +856,33 @@ int main(int argc, char **argv)
     }
 
     const char *prog = guess_prog();
+    bool prog_given = 0;
 
     int opt;
     static const struct option opts[] =
     {
         {"fast",		0, 0, '1'},
         {"best",		0, 0, '9'},
+        {"threads",		1, 0, 'T'},
+        {"jobs",		1, 0, 'j'},
+        {"block-size",		1, 0, OPT_BLOCK_SIZE},
+        {"memlimit",		1, 0, 'M'},
+        {"mmap",		0, 0, OPT_MMAP},
+        {"rsyncable",		0, 0, OPT_RSYNCABLE},
+        {"long",		2, 0, OPT_LONG},
+        {"adaptive",		2, 0, OPT_ADAPTIVE},
+        {"seekable",		2, 0, OPT_SEEKABLE},
+        {"range",		1, 0, OPT_RANGE},
+        {"build-index",		2, 0, OPT_BUILD_INDEX},
+        {"recompress",		0, 0, OPT_RECOMPRESS},
+        {"io-uring",		0, 0, OPT_IO_URING},
+        {"dict",		1, 0, 'D'},
+        {"train",		1, 0, OPT_TRAIN},
+        {"stats",		1, 0, OPT_STATS},
+        {"stats-fd",		1, 0, OPT_STATS_FD},
+        {0},
     };
-    while ((opt = getopt_long(argc, argv, "cdzfklnqvrthF:0123456789", opts, 0)) != -1)
+    while ((opt = getopt_long(argc, argv, "cdzfklnqvrthb::D:F:M:T:j:0123456789", opts, 0)) != -1)
         switch (opt)
         {
         case 'c':
@@ -305,7 +901,8 @@ int main(int argc, char **argv)
             keep = 1;
             break;
         case 'l':
-            die("%s: -l: unsupported\n", exe);
+            op = 'l';
+            break;
         case 'n':
             // silently ignored
             break;
@@ -323,6 +920,109 @@ int main(int argc, char **argv)
             break;
         case 'F':
             prog = optarg;
+            prog_given = 1;
+            break;
+        case 'T':
+            threads = parse_threads(optarg, "thread count");
+            break;
+        case 'j':
+            jobs = parse_threads(optarg, "job count");
+            break;
+        case OPT_BLOCK_SIZE:
+            block_size = parse_size(optarg, "block size");
+            break;
+        case 'M':
+            memlimit = parse_size(optarg, "memory limit");
+            break;
+        case OPT_MMAP:
+            use_mmap = 1;
+            break;
+        case OPT_RSYNCABLE:
+            rsyncable = 1;
+            break;
+        case 'b':
+            bench_lo = 1, bench_hi = 9;
+            if (optarg)
+            {
+                char *end;
+                bench_lo = bench_hi = strtol(optarg, &end, 10);
+                if (*end == '-')
+                    bench_hi = strtol(end + 1, &end, 10);
+                if (*end || bench_lo < 1 || bench_hi > 9 || bench_lo > bench_hi)
+                    die("%s: invalid level range '%s'\n", exe, optarg);
+            }
+            break;
+        case 'D':
+            dict = optarg;
+            break;
+        case OPT_TRAIN:
+            train = optarg;
+            break;
+        case OPT_ADAPTIVE:
+            adapt_lo = 1, adapt_hi = 9;
+            if (optarg)
+            {
+                char *end;
+                adapt_lo = strtol(optarg, &end, 10);
+                if (*end == ':')
+                    adapt_hi = strtol(end + 1, &end, 10);
+                if (end == optarg || *end || adapt_lo < 1 || adapt_hi > 9 || adapt_lo > adapt_hi)
+                    die("%s: invalid level range '%s'\n", exe, optarg);
+            }
+            break;
+        case OPT_SEEKABLE:
+            seek_frame = optarg? parse_size(optarg, "frame size") : SEEK_FRAME;
+            if (!seek_frame || seek_frame > GB)
+                die("%s: invalid frame size '%s'\n", exe, optarg);
+            break;
+        case OPT_RECOMPRESS:
+            recomp = 1;
+            break;
+        case OPT_IO_URING:
+            use_uring = 1;
+            break;
+        case OPT_BUILD_INDEX:
+            index_span = optarg? parse_size(optarg, "index spacing") : INDEX_SPAN;
+            if (!index_span)
+                die("%s: invalid index spacing '%s'\n", exe, optarg);
+            break;
+        case OPT_RANGE:
+        {
+            // offset[:length], the latter to the end if not given
+            char *colon = strchr(optarg, ':');
+            if (colon)
+                *colon = 0;
+            range_off = parse_size(optarg, "range offset");
+            range_len = colon? parse_size(colon + 1, "range length") : ULLONG_MAX;
+            if (colon)
+                *colon = ':';
+            if (!range_len)
+                die("%s: invalid range '%s'\n", exe, optarg);
+            break;
+        }
+        case OPT_STATS:
+            if (strcmp(optarg, "json"))
+                die("%s: unknown stats format '%s'\n", exe, optarg);
+            if (stats_fd == -1)
+                stats_fd = 2;
+            break;
+        case OPT_STATS_FD:
+        {
+            char *end;
+            stats_fd = strtol(optarg, &end, 10);
+            if (end == optarg || *end || stats_fd < 0 || fcntl(stats_fd, F_GETFD) == -1)
+                die("%s: invalid stats fd '%s'\n", exe, optarg);
+            break;
+        }
+        case OPT_LONG:
+            long_window = 27; // same as zstd's
+            if (optarg)
+            {
+                char *end;
+                long_window = strtol(optarg, &end, 10);
+                if (end == optarg || *end || long_window < 10 || long_window > 31)
+                    die("%s: invalid window log '%s'\n", exe, optarg);
+            }
             break;
         case '0':
             level = 1;
@@ -335,15 +1035,98 @@ int main(int argc, char **argv)
             exit(1);
         }
 
+    if (recomp && op)
+        die("%s: --recompress doesn't go with -d, -t or -l\n", exe);
+    // reads the whole file but writes only the index
+    if (index_span)
+        op = 't';
+
     comp = comp_by_name(prog, op? decompressors : compressors);
     if (!comp)
         die("%s: no such format known '%s'\n", exe, prog);
 
+    if (bench_lo)
+    {
+        // all formats unless one was asked for
+        compress_info *only = prog_given? comp_by_name(prog, compressors) : 0;
+        if (dict && (load_dict(dict, 0) || load_dict(dict, 1)))
+            exit(1);
+        if (optind >= argc)
+            return benchmark(0, only, bench_lo, bench_hi);
+        for (; optind < argc; optind++)
+            err |= benchmark(argv[optind], only, bench_lo, bench_hi);
+        return err;
+    }
+
+    const char *why;
+    if (!op && !train && (why = comp_load(comp)))
+        die("%s: %s\n", exe, why);
+
+    if (train)
+    {
+        if (optind >= argc)
+            die("%s: --train needs sample files\n", exe);
+        jobs = 1; // samples are gathered in order
+    }
+    if (op == 'l')
+        jobs = 1; // and so are lines
+    if (seek_frame && !op && strcmp(comp->name, "zstd"))
+        die("%s: --seekable works only with zstd\n", exe);
+    if (long_window && !op && strcmp(comp->name, "zstd"))
+        die("%s: --long works only with zstd\n", exe);
+    if (range_len && !op)
+        die("%s: --range is for decompressing\n", exe);
+    // a part can't take the place of the whole file
+    if (range_len && op == 'd' && !cat)
+        die("%s: --range needs -c\n", exe);
+    if (adapt_hi && !op && strcmp(comp->name, "zstd") && strcmp(comp->name, "gzip"))
+        die("%s: --adaptive works only with zstd and gzip\n", exe);
+    // a dictionary is made for one level, for the whole frame
+    if (adapt_hi && !op && dict)
+        die("%s: --adaptive doesn't go with -D\n", exe);
+    if (dict)
+    {
+        if (!op && strcmp(comp->name, "zstd"))
+            die("%s: -D works only with zstd\n", exe);
+        if (load_dict(dict, op))
+            exit(1);
+    }
+
     if (optind >= argc)
-        do_file(-1, "stdin", "", 0, 0);
+        do_file(-1, "stdin", "", 0, 0, 0);
     else
+    {
+        // all files would go to the same stdout
+        if (jobs > 1 && !cat)
+            start_jobs();
+#ifdef HAVE_IO_URING
+        // falls back to plain syscalls if the kernel won't
+        static const uint8_t ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ};
+        if (recurse && use_uring)
+            have_uring = uring_init(&ur, 2 * BATCH, ops, ARRAYSZ(ops));
+        if (recurse && use_uring && !have_uring && verbose)
+            fprintf(stderr, "%s: io_uring not allowed, reading files the usual way\n", exe);
+#else
+        if (recurse && use_uring && verbose)
+            fprintf(stderr, "%s: built without io_uring, reading files the usual way\n", exe);
+#endif
         for (; optind < argc; optind++)
-            do_dir(AT_FDCWD, argv[optind], "");
+            do_dir(&cwd, argv[optind]);
+        if (queue.nthreads)
+            finish_jobs();
+#ifdef HAVE_IO_URING
+        if (have_uring)
+            uring_free(&ur);
+#endif
+    }
+    if (train && train_dict(train, force))
+        set_err(1);
+    if (listed.files > 1)
+    {
+        put_size(listed.sz, listed.unknown? SIZE_UNKNOWN : listed.sd);
+        printf(" %-6s %s\n", "", "(totals)");
+    }
 
+    pool_free();
     return err;
 }
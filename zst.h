@@ -4,3 +4,12 @@
 
 extern const char *exe;
 extern int level;
+extern int threads;
+extern unsigned long long block_size;
+extern unsigned long long memlimit;
+extern bool rsyncable;
+extern int long_window;
+extern int adapt_lo, adapt_hi;
+extern unsigned long long seek_frame;
+extern unsigned long long range_off, range_len;
+extern unsigned long long index_span;